@@ -4,6 +4,7 @@
 #include <stringImproved.h>
 #include <vectorUtils.h>
 #include <string.h>
+#include <io/dataView.h>
 
 
 namespace sp {
@@ -12,6 +13,8 @@ namespace io {
 class DataBuffer
 {
 public:
+    static constexpr size_t max_vlq_size = DataView::max_vlq_size;
+
     DataBuffer()
     : read_index(0)
     {
@@ -21,6 +24,11 @@ public:
     : buffer(std::move(b.buffer)), read_index(b.read_index)
     {
     }
+
+    ~DataBuffer()
+    {
+        releaseStorage();
+    }
     
     template<typename... ARGS> explicit DataBuffer(ARGS&&... args)
     : DataBuffer()
@@ -30,10 +38,19 @@ public:
     
     void operator=(std::vector<uint8_t>&& data)
     {
+         releaseStorage();
          buffer = std::move(data);
          read_index = 0;
     }
 
+    //Exchange the contents with raw storage and start reading from the start.
+    // Lets a producer, like a socket, reuse the previous storage of the buffer instead of allocating.
+    void swap(std::vector<uint8_t>& data)
+    {
+        buffer.swap(data);
+        read_index = 0;
+    }
+
     void clear()
     {
         buffer.clear();
@@ -53,11 +70,7 @@ public:
     void appendRaw(const void* ptr, size_t size)
     {
         if (size > 0)
-        {
-            auto offset = buffer.size();
-            buffer.resize(offset + size);
-            memcpy(buffer.data() + offset, ptr, size);
-        }
+            memcpy(reserveForWrite(size), ptr, size);
     }
     
     template<typename T, typename... ARGS> void write(const T& value, ARGS&&... args)
@@ -68,17 +81,17 @@ public:
     
     void write(bool b)
     {
-        buffer.push_back(b ? 1 : 0);
+        *reserveForWrite(1) = b ? 1 : 0;
     }
     
     void write(uint8_t i)
     {
-        buffer.push_back(i);
+        *reserveForWrite(1) = i;
     }
 
     void write(int8_t i)
     {
-        buffer.push_back(i);
+        *reserveForWrite(1) = uint8_t(i);
     }
 
     void write(int16_t i)
@@ -137,78 +150,104 @@ public:
         read(args...);
     }
 
-    void read(bool& b)
-    {
-        if (read_index >= buffer.size()) { b = false; return; }
-        b = buffer[read_index++];
-    }
-    
-    void read(uint8_t& i)
+    //Reading is done by DataView, on the part that has not been read yet.
+    void read(bool& b) { readFromView(b); }
+    void read(uint8_t& i) { readFromView(i); }
+    void read(int8_t& i) { readFromView(i); }
+    void read(int16_t& i) { readFromView(i); }
+    void read(int32_t& i) { readFromView(i); }
+    void read(uint16_t& i) { readFromView(i); }
+    void read(uint32_t& i) { readFromView(i); }
+    void read(float& f) { readFromView(f); }
+    void read(double& f) { readFromView(f); }
+    void read(string& s) { readFromView(s); }
+
+    template<typename T> void read(sf::Vector2<T>& v)
     {
-        if (read_index >= buffer.size()) { i = 0; return; }
-        i = buffer[read_index++];
+        read(v.x);
+        read(v.y);
     }
 
-    void read(int8_t& i)
+    template<class T, class=typename std::enable_if<std::is_enum<T>::value>::type>
+    void read(T& enum_value) { uint16_t v=0; read(v); enum_value = T(v); }
+
+    bool readRaw(void* ptr, size_t size)
     {
-        if (read_index >= buffer.size()) { i = 0; return; }
-        i = buffer[read_index++];
+        DataView view = getView();
+        bool result = view.readRaw(ptr, size);
+        read_index += view.getReadSize();
+        return result;
     }
 
-    void read(int16_t& i)
+    //Take the next size bytes as a view, without copying. The view is valid till this buffer is changed.
+    bool readView(DataView& result, size_t size)
     {
-        i = readVLQs();
+        DataView view = getView();
+        bool success = view.readView(result, size);
+        read_index += view.getReadSize();
+        return success;
     }
-    void read(int32_t& i)
+
+    //View on the part that has not been read yet, for forwarding a payload without copying it.
+    DataView getView() const
     {
-        i = readVLQs();
+        return DataView(buffer.data() + read_index, buffer.size() - read_index);
     }
-    
-    void read(uint16_t& i)
+
+    size_t available() const
     {
-        i = readVLQu();
+        return buffer.size() - read_index;
     }
-    
-    void read(uint32_t& i)
+
+    //Prefix data with a VLQ that is only known after writing it, like its size. Reserves room for the VLQ,
+    // returns the offset of the data, which goes to writeVLQBefore together with the value once the data is written.
+    size_t reserveVLQ()
     {
-        i = readVLQu();
+        reserveForWrite(1);
+        return buffer.size();
     }
 
-    void read(float& f)
+    void writeVLQBefore(size_t data_offset, uint32_t value)
     {
-        if (read_index + sizeof(f) > buffer.size()) { f = 0; return; }
-        memcpy(&f, &buffer[read_index], sizeof(f));
-        read_index += sizeof(f);
+        //Room for a single byte is reserved, larger values move the data.
+        size_t extra = vlqSize(value) - 1;
+        if (extra > 0)
+        {
+            size_t data_size = buffer.size() - data_offset;
+            reserveForWrite(extra);
+            memmove(buffer.data() + data_offset + extra, buffer.data() + data_offset, data_size);
+        }
+        encodeVLQu(buffer.data() + data_offset - 1, value);
     }
 
-    void read(double& f)
+    //Bulk versions of write/read, the values are stored exactly as with individual write/read calls, without a count.
+    void writeArray(const int32_t* values, size_t count)
     {
-        if (read_index + sizeof(f) > buffer.size()) { f = 0; return; }
-        memcpy(&f, &buffer[read_index], sizeof(f));
-        read_index += sizeof(f);
+        uint8_t* ptr = reserveForWrite(count * max_vlq_size);
+        for(size_t n=0; n<count; n++)
+            ptr = encodeVLQu(ptr, zigzag(values[n]));
+        buffer.resize(ptr - buffer.data());
     }
 
-    template<typename T> void read(sf::Vector2<T>& v)
+    void writeArray(const uint32_t* values, size_t count)
     {
-        read(v.x);
-        read(v.y);
+        uint8_t* ptr = reserveForWrite(count * max_vlq_size);
+        for(size_t n=0; n<count; n++)
+            ptr = encodeVLQu(ptr, values[n]);
+        buffer.resize(ptr - buffer.data());
     }
 
-    void read(string& s)
+    void writeArray(const float* values, size_t count)
     {
-        uint32_t len = 0;
-        read(len);
-        if (read_index + len > buffer.size()) return;
-        s.assign(reinterpret_cast<char*>(&buffer[read_index]), len);
-        read_index += len;
+        appendRaw(values, count * sizeof(float));
     }
 
-    template<class T, class=typename std::enable_if<std::is_enum<T>::value>::type>
-    void read(T& enum_value) { uint16_t v=0; read(v); enum_value = T(v); }
-
-    size_t available() const
+    template<typename T> bool readArray(T* values, size_t count)
     {
-        return buffer.size() - read_index;
+        DataView view = getView();
+        bool result = view.readArray(values, count);
+        read_index += view.getReadSize();
+        return result;
     }
 
     DataBuffer& operator <<(bool data) { write(data); return *this; }
@@ -232,45 +271,103 @@ public:
     DataBuffer& operator >>(float& data) { read(data); return *this; }
     DataBuffer& operator >>(double& data) { read(data); return *this; }
     DataBuffer& operator >>(string& data) { read(data); return *this; }
+
+    //Encode a VLQ into memory with room for max_vlq_size bytes, returns the number of bytes written.
+    static size_t encodeVLQ(uint8_t* ptr, uint32_t v)
+    {
+        return encodeVLQu(ptr, v) - ptr;
+    }
 private:
-    void writeVLQu(uint32_t v) {
-        if (v >= (1 << 28))
-            buffer.push_back((v >> 28) | 0x80);
-        if (v >= (1 << 21))
-            buffer.push_back((v >> 21) | 0x80);
-        if (v >= (1 << 14))
-            buffer.push_back((v >> 14) | 0x80);
-        if (v >= (1 << 7))
-            buffer.push_back((v >> 7) | 0x80);
-        buffer.push_back((v & 0x7F));
+    static constexpr size_t initial_capacity = 64;
+    static constexpr size_t max_pooled_capacity = 64 * 1024; //Do not keep the storage of exceptionally large packets around.
+    static constexpr size_t max_pool_size = 64;
+
+    struct StoragePool
+    {
+        std::vector<std::vector<uint8_t>> buffers;
+
+        ~StoragePool() { destroyed() = true; }
+        //Buffers destroyed during thread exit, after the pool itself, just free their storage.
+        static bool& destroyed() { static thread_local bool value = false; return value; }
+    };
+
+    static StoragePool& storagePool()
+    {
+        static thread_local StoragePool pool;
+        return pool;
     }
 
-    void writeVLQs(int32_t v) {
+    //Take storage from a previously destroyed buffer, so building packets does not allocate in steady state.
+    void takeStorage()
+    {
+        if (!StoragePool::destroyed() && !storagePool().buffers.empty())
+        {
+            auto& pool = storagePool();
+            buffer = std::move(pool.buffers.back());
+            pool.buffers.pop_back();
+        }else{
+            buffer.reserve(initial_capacity);
+        }
+    }
+
+    void releaseStorage()
+    {
+        if (buffer.capacity() == 0 || buffer.capacity() > max_pooled_capacity || StoragePool::destroyed())
+            return;
+        auto& pool = storagePool();
+        if (pool.buffers.size() >= max_pool_size)
+            return;
+        buffer.clear();
+        pool.buffers.push_back(std::move(buffer));
+    }
+
+    static size_t vlqSize(uint32_t v)
+    {
+        return 1 + (v >= (1 << 7)) + (v >= (1 << 14)) + (v >= (1 << 21)) + (v >= (1 << 28));
+    }
+
+    static uint32_t zigzag(int32_t v)
+    {
         if (v < 0)
-            writeVLQu((uint32_t(-v) << 1) | 1);
-        else
-            writeVLQu((uint32_t(v) << 1));
+            return (uint32_t(-v) << 1) | 1;
+        return uint32_t(v) << 1;
     }
 
-    uint32_t readVLQu()
+    //Encode into memory that has room for at least vlqSize(v) bytes, returns the end of the written data.
+    static uint8_t* encodeVLQu(uint8_t* ptr, uint32_t v)
     {
-        uint32_t result{0};
-        uint8_t u;
-        do
-        {
-            result <<= 7;
-            if (read_index >= buffer.size()) { return result; }
-            u = buffer[read_index++];
-            result |= u & 0x7F;
-        } while(u & 0x80);
-        return result;
+        size_t size = vlqSize(v);
+        for(size_t n=size-1; n>0; n--)
+            *ptr++ = uint8_t(v >> (7 * n)) | 0x80;
+        *ptr++ = uint8_t(v & 0x7F);
+        return ptr;
+    }
+
+    //Grow the buffer by size bytes, returns the start of the new space.
+    // Storage is only taken on the first write, buffers that are just moved or read from never touch the pool.
+    uint8_t* reserveForWrite(size_t size)
+    {
+        if (buffer.capacity() == 0)
+            takeStorage();
+        size_t offset = buffer.size();
+        buffer.resize(offset + size);
+        return buffer.data() + offset;
+    }
+
+    void writeVLQu(uint32_t v) {
+        uint8_t* ptr = reserveForWrite(vlqSize(v));
+        encodeVLQu(ptr, v);
+    }
+
+    void writeVLQs(int32_t v) {
+        writeVLQu(zigzag(v));
     }
 
-    int32_t readVLQs()
+    template<typename T> void readFromView(T& value)
     {
-        uint32_t v = readVLQu();
-        if (v & 1) return -int32_t(v >> 1);
-        return int32_t(v >> 1);
+        DataView view = getView();
+        view.read(value);
+        read_index += view.getReadSize();
     }
 
     std::vector<uint8_t> buffer;
@@ -0,0 +1,248 @@
+#ifndef SP2_IO_DATAVIEW_H
+#define SP2_IO_DATAVIEW_H
+
+#include <stringImproved.h>
+#include <vectorUtils.h>
+#include <string.h>
+
+
+namespace sp {
+namespace io {
+
+//Read-only view on serialized data, in the format written by DataBuffer, without owning or copying the data.
+//The viewed memory has to stay valid, and unchanged, for as long as the view is used.
+class DataView
+{
+public:
+    static constexpr size_t max_vlq_size = 5;
+
+    DataView()
+    : data(nullptr), size(0), read_index(0)
+    {
+    }
+
+    DataView(const void* data, size_t size)
+    : data(static_cast<const uint8_t*>(data)), size(size), read_index(0)
+    {
+    }
+
+    const void* getData() const { return data; }
+    size_t getDataSize() const { return size; }
+
+    //The part that has not been read yet, for forwarding a payload without copying it.
+    const void* getRemainingData() const { return data + read_index; }
+    size_t available() const { return size - read_index; }
+    size_t getReadSize() const { return read_index; }
+
+    template<typename T, typename... ARGS> void read(T& value, ARGS&... args)
+    {
+        read(value);
+        read(args...);
+    }
+
+    void read(bool& b)
+    {
+        if (read_index >= size) { b = false; return; }
+        b = data[read_index++];
+    }
+
+    void read(uint8_t& i)
+    {
+        if (read_index >= size) { i = 0; return; }
+        i = data[read_index++];
+    }
+
+    void read(int8_t& i)
+    {
+        if (read_index >= size) { i = 0; return; }
+        i = data[read_index++];
+    }
+
+    void read(int16_t& i)
+    {
+        i = readVLQs();
+    }
+
+    void read(int32_t& i)
+    {
+        i = readVLQs();
+    }
+
+    void read(uint16_t& i)
+    {
+        i = readVLQu();
+    }
+
+    void read(uint32_t& i)
+    {
+        i = readVLQu();
+    }
+
+    void read(float& f)
+    {
+        if (read_index + sizeof(f) > size) { f = 0; return; }
+        memcpy(&f, data + read_index, sizeof(f));
+        read_index += sizeof(f);
+    }
+
+    void read(double& f)
+    {
+        if (read_index + sizeof(f) > size) { f = 0; return; }
+        memcpy(&f, data + read_index, sizeof(f));
+        read_index += sizeof(f);
+    }
+
+    template<typename T> void read(sf::Vector2<T>& v)
+    {
+        read(v.x);
+        read(v.y);
+    }
+
+    void read(string& s)
+    {
+        uint32_t len = 0;
+        read(len);
+        if (read_index + len > size) return;
+        s.assign(reinterpret_cast<const char*>(data + read_index), len);
+        read_index += len;
+    }
+
+    template<class T, class=typename std::enable_if<std::is_enum<T>::value>::type>
+    void read(T& enum_value) { uint16_t v=0; read(v); enum_value = T(v); }
+
+    bool readRaw(void* ptr, size_t size)
+    {
+        if (read_index + size > this->size) { read_index = this->size; return false; }
+        if (size > 0)
+            memcpy(ptr, data + read_index, size);
+        read_index += size;
+        return true;
+    }
+
+    //Take the next size bytes as a view of their own, without copying them.
+    bool readView(DataView& view, size_t size)
+    {
+        if (read_index + size > this->size) { read_index = this->size; view = DataView(); return false; }
+        view = DataView(data + read_index, size);
+        read_index += size;
+        return true;
+    }
+
+    bool readArray(int32_t* values, size_t count)
+    {
+        if (available() >= count * max_vlq_size)
+        {
+            //Enough data for the worst case, decode without any bounds checks.
+            const uint8_t* ptr = data + read_index;
+            for(size_t n=0; n<count; n++)
+                values[n] = unzigzag(decodeVLQu(ptr));
+            read_index = ptr - data;
+            return true;
+        }
+        bool complete = true;
+        for(size_t n=0; n<count; n++)
+        {
+            uint32_t v = 0;
+            complete = readVLQu(v) && complete;
+            values[n] = unzigzag(v);
+        }
+        return complete;
+    }
+
+    bool readArray(uint32_t* values, size_t count)
+    {
+        if (available() >= count * max_vlq_size)
+        {
+            const uint8_t* ptr = data + read_index;
+            for(size_t n=0; n<count; n++)
+                values[n] = decodeVLQu(ptr);
+            read_index = ptr - data;
+            return true;
+        }
+        bool complete = true;
+        for(size_t n=0; n<count; n++)
+            complete = readVLQu(values[n]) && complete;
+        return complete;
+    }
+
+    bool readArray(float* values, size_t count)
+    {
+        return readRaw(values, count * sizeof(float));
+    }
+
+    DataView& operator >>(bool& data) { read(data); return *this; }
+    DataView& operator >>(int8_t& data) { read(data); return *this; }
+    DataView& operator >>(uint8_t& data) { read(data); return *this; }
+    DataView& operator >>(int16_t& data) { read(data); return *this; }
+    DataView& operator >>(uint16_t& data) { read(data); return *this; }
+    DataView& operator >>(int32_t& data) { read(data); return *this; }
+    DataView& operator >>(uint32_t& data) { read(data); return *this; }
+    DataView& operator >>(float& data) { read(data); return *this; }
+    DataView& operator >>(double& data) { read(data); return *this; }
+    DataView& operator >>(string& data) { read(data); return *this; }
+private:
+    static int32_t unzigzag(uint32_t v)
+    {
+        if (v & 1) return -int32_t(v >> 1);
+        return int32_t(v >> 1);
+    }
+
+    //Decode from memory that is known to hold a complete value, or at least max_vlq_size bytes.
+    static uint32_t decodeVLQu(const uint8_t*& ptr)
+    {
+        uint32_t result = 0;
+        for(size_t n=0; n<max_vlq_size; n++)
+        {
+            uint8_t u = *ptr++;
+            result = (result << 7) | (u & 0x7F);
+            if (!(u & 0x80))
+                break;
+        }
+        return result;
+    }
+
+    //Returns false if the value was cut off by the end of the data.
+    bool readVLQu(uint32_t& result)
+    {
+        if (available() >= max_vlq_size)
+        {
+            const uint8_t* ptr = data + read_index;
+            result = decodeVLQu(ptr);
+            read_index = ptr - data;
+            return true;
+        }
+        //Near the end of the data, check every byte.
+        result = 0;
+        uint8_t u;
+        do
+        {
+            result <<= 7;
+            if (read_index >= size) { return false; }
+            u = data[read_index++];
+            result |= u & 0x7F;
+        } while(u & 0x80);
+        return true;
+    }
+
+    uint32_t readVLQu()
+    {
+        uint32_t result;
+        readVLQu(result);
+        return result;
+    }
+
+    int32_t readVLQs()
+    {
+        return unzigzag(readVLQu());
+    }
+
+    const uint8_t* data;
+    size_t size;
+    size_t read_index;
+};
+
+}//namespace io
+}//namespace sp
+
+
+#endif//SP2_IO_DATAVIEW_H
@@ -0,0 +1,112 @@
+#include <io/mappedFile.h>
+#include <logging.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#endif
+
+
+namespace sp {
+namespace io {
+
+MappedFile::MappedFile()
+: data(nullptr), size(0)
+#ifdef _WIN32
+, file_handle(nullptr), mapping_handle(nullptr)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const string& filename)
+{
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_handle = file;
+    mapping_handle = mapping;
+    data = static_cast<const uint8_t*>(view);
+    size = size_t(file_size.QuadPart);
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    //The mapping keeps its own reference to the file.
+    ::close(fd);
+    if (view == MAP_FAILED)
+    {
+        LOG(Warning, "Failed to map file: ", filename);
+        return false;
+    }
+    data = static_cast<const uint8_t*>(view);
+    size = size_t(file_stat.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (!data)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(mapping_handle);
+    CloseHandle(file_handle);
+    mapping_handle = nullptr;
+    file_handle = nullptr;
+#else
+    munmap(const_cast<uint8_t*>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+bool replaceFile(const string& source, const string& target)
+{
+#ifdef _WIN32
+    return MoveFileExA(source.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(source.c_str(), target.c_str()) == 0;
+#endif
+}
+
+}//namespace io
+}//namespace sp
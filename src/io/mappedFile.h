@@ -0,0 +1,44 @@
+#ifndef SP2_IO_MAPPEDFILE_H
+#define SP2_IO_MAPPEDFILE_H
+
+#include <stringImproved.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace sp {
+namespace io {
+
+//Read-only memory mapping of a complete file, so large files can be read without copying them into memory first.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& filename);
+    void close();
+
+    bool isOpen() const { return data != nullptr; }
+    const void* getData() const { return data; }
+    size_t getDataSize() const { return size; }
+private:
+    const uint8_t* data;
+    size_t size;
+#ifdef _WIN32
+    void* file_handle;
+    void* mapping_handle;
+#endif
+};
+
+//Move source over target in a single step, replacing target if it exists. A reader finds either the old or the new file, never none.
+bool replaceFile(const string& source, const string& target);
+
+}//namespace io
+}//namespace sp
+
+
+#endif//SP2_IO_MAPPEDFILE_H
@@ -8,6 +8,7 @@ static constexpr int flags = 0;
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -130,6 +131,17 @@ namespace io {
 namespace network {
 
 
+TcpSocket::SharedFrame TcpSocket::makeSharedFrame(const io::DataBuffer& buffer)
+{
+    uint8_t header[io::DataBuffer::max_vlq_size];
+    size_t header_size = io::DataBuffer::encodeVLQ(header, buffer.getDataSize());
+    auto frame = std::make_shared<std::string>();
+    frame->reserve(header_size + buffer.getDataSize());
+    frame->append(reinterpret_cast<const char*>(header), header_size);
+    frame->append(static_cast<const char*>(buffer.getData()), buffer.getDataSize());
+    return frame;
+}
+
 TcpSocket::TcpSocket()
 : ssl_handle(nullptr)
 {
@@ -154,12 +166,14 @@ TcpSocket& TcpSocket::operator=(TcpSocket&& socket)
     handle = socket.handle;
     ssl_handle = socket.ssl_handle;
     send_queue = std::move(socket.send_queue);
+    send_queue_size = socket.send_queue_size;
     blocking = socket.blocking;
     receive_buffer = std::move(socket.receive_buffer);
     received_size = socket.received_size;
+    statistics = socket.statistics;
 
     socket.handle = INVALID_SOCKET;
-    socket.send_queue.clear();
+    socket.clearSendQueue();
     socket.receive_buffer.clear();
     socket.received_size = 0;
     socket.ssl_handle = nullptr;
@@ -259,7 +273,11 @@ void TcpSocket::close()
         ::close(handle);
 #endif
         handle = INVALID_SOCKET;
-        send_queue.clear();
+        clearSendQueue();
+        //Drop a partially received frame, so a reconnect starts at a frame boundary.
+        receive_packet_size = 0;
+        receive_packet_size_done = false;
+        received_size = 0;
         if (ssl_handle)
             SSL_free(static_cast<SSL*>(ssl_handle));
         ssl_handle = nullptr;
@@ -293,16 +311,82 @@ void TcpSocket::send(const void* data, size_t size)
             if (!isLastErrorNonBlocking())
                 close();
             else
-                send_queue += std::string(static_cast<const char*>(data) + done, size - done);
+                queue(static_cast<const char*>(data) + done, size - done);
             return;
         }
         done += result;
+        statistics.bytes_sent += result;
     }
 }
 
 void TcpSocket::queue(const void* data, size_t size)
 {
-    send_queue += std::string(static_cast<const char*>(data), size);
+    appendToQueue(data, size);
+    statistics.peak_send_queue_size = std::max(statistics.peak_send_queue_size, send_queue_size);
+}
+
+void TcpSocket::queue(const SharedFrame& frame)
+{
+    if (!frame || frame->empty())
+        return;
+    QueuedData entry;
+    entry.shared = frame;
+    send_queue.push_back(std::move(entry));
+    send_queue_size += frame->size();
+    statistics.frames_sent++;
+    statistics.peak_send_queue_size = std::max(statistics.peak_send_queue_size, send_queue_size);
+}
+
+void TcpSocket::appendToQueue(const void* data, size_t size)
+{
+    if (size == 0)
+        return;
+    //Copies go into the last segment, so a run of small frames still ends up in one buffer.
+    // Once sending has started on that segment it is closed, sent bytes are only released when a segment has fully drained,
+    // so a receiver that stays just behind would otherwise keep one segment growing forever.
+    if (send_queue.empty() || send_queue.back().shared || send_queue.back().offset > 0)
+    {
+        send_queue.emplace_back();
+        send_queue.back().owned.swap(spare_queue_buffer);
+    }
+    send_queue.back().owned.append(static_cast<const char*>(data), size);
+    send_queue_size += size;
+}
+
+void TcpSocket::consumeSendQueue(size_t size)
+{
+    send_queue_size -= size;
+    while(size > 0)
+    {
+        QueuedData& front = send_queue.front();
+        size_t remaining = front.size() - front.offset;
+        if (size < remaining)
+        {
+            front.offset += size;
+            return;
+        }
+        size -= remaining;
+        if (!front.shared && front.owned.capacity() > spare_queue_buffer.capacity())
+        {
+            front.owned.clear();
+            spare_queue_buffer.swap(front.owned);
+        }
+        send_queue.pop_front();
+    }
+}
+
+size_t TcpSocket::getSendQueueStorage() const
+{
+    size_t result = spare_queue_buffer.capacity();
+    for(const auto& entry : send_queue)
+        result += entry.owned.capacity();
+    return result;
+}
+
+void TcpSocket::clearSendQueue()
+{
+    send_queue.clear();
+    send_queue_size = 0;
 }
 
 size_t TcpSocket::receive(void* data, size_t size)
@@ -323,21 +407,33 @@ size_t TcpSocket::receive(void* data, size_t size)
         if (!isLastErrorNonBlocking())
             close();
     }
+    statistics.bytes_received += result;
     return result;
 }
 
 void TcpSocket::send(const io::DataBuffer& buffer)
 {
-    io::DataBuffer packet_size(uint32_t(buffer.getDataSize()));
-    send(packet_size.getData(), packet_size.getDataSize());
-    send(buffer.getData(), buffer.getDataSize());
+    if (!isConnected())
+        return;
+    //Frame header and data go out together through the send queue, in a single system call.
+    appendFrame(buffer);
+    sendSendQueue();
+    statistics.peak_send_queue_size = std::max(statistics.peak_send_queue_size, send_queue_size);
 }
 
 void TcpSocket::queue(const io::DataBuffer& buffer)
 {
-    io::DataBuffer packet_size(uint32_t(buffer.getDataSize()));
-    queue(packet_size.getData(), packet_size.getDataSize());
-    queue(buffer.getData(), buffer.getDataSize());
+    appendFrame(buffer);
+    statistics.peak_send_queue_size = std::max(statistics.peak_send_queue_size, send_queue_size);
+}
+
+void TcpSocket::appendFrame(const io::DataBuffer& buffer)
+{
+    uint8_t header[io::DataBuffer::max_vlq_size];
+    size_t header_size = io::DataBuffer::encodeVLQ(header, buffer.getDataSize());
+    appendToQueue(header, header_size);
+    appendToQueue(buffer.getData(), buffer.getDataSize());
+    statistics.frames_sent++;
 }
 
 bool TcpSocket::receive(io::DataBuffer& buffer)
@@ -365,6 +461,7 @@ bool TcpSocket::receive(io::DataBuffer& buffer)
             }
             if (result == 0)
                 return false;
+            statistics.bytes_received += result;
             receive_packet_size = (receive_packet_size << 7) | (size_buffer[0] & 0x7F);
             if (!(size_buffer[0] & 0x80))
                 receive_packet_size_done = true;
@@ -392,11 +489,14 @@ bool TcpSocket::receive(io::DataBuffer& buffer)
             }
         }
         received_size += result;
+        statistics.bytes_received += result;
         if (received_size == receive_buffer.size())
         {
-            buffer = std::move(receive_buffer);
+            //Swap, so the previous storage of the buffer is reused for the next frame.
+            buffer.swap(receive_buffer);
             received_size = 0;
             receive_packet_size_done = false;
+            statistics.frames_received++;
             return true;
         }
         if (result < 1)
@@ -408,27 +508,51 @@ bool TcpSocket::receive(io::DataBuffer& buffer)
 
 bool TcpSocket::sendSendQueue()
 {
-    if (send_queue.size() < 1)
-        return false;
-    
-    int result;
-    do
+    while(send_queue_size > 0)
     {
-        if (ssl_handle)
-            result = SSL_write(static_cast<SSL*>(ssl_handle), static_cast<const char*>(send_queue.data()), send_queue.size());
+        int result;
+#ifndef _WIN32
+        if (!ssl_handle && send_queue.size() > 1)
+        {
+            //Hand multiple segments to the OS at once, so queued shared frames do not cost a system call each.
+            struct iovec segments[max_send_segments];
+            size_t segment_count = 0;
+            for(const auto& entry : send_queue)
+            {
+                if (segment_count == max_send_segments)
+                    break;
+                segments[segment_count].iov_base = const_cast<char*>(entry.data() + entry.offset);
+                segments[segment_count].iov_len = entry.size() - entry.offset;
+                segment_count++;
+            }
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = segments;
+            message.msg_iovlen = segment_count;
+            result = ::sendmsg(handle, &message, flags);
+        }
         else
-            result = ::send(handle, static_cast<const char*>(send_queue.data()), send_queue.size(), flags);
+#endif
+        {
+            const QueuedData& front = send_queue.front();
+            if (ssl_handle)
+                result = SSL_write(static_cast<SSL*>(ssl_handle), front.data() + front.offset, front.size() - front.offset);
+            else
+                result = ::send(handle, front.data() + front.offset, front.size() - front.offset, flags);
+        }
         if (result < 0)
         {
-            result = 0;
             if (!isLastErrorNonBlocking())
                 close();
+            break;
         }
-        if (result > 0)
-            send_queue = send_queue.substr(result);
-    } while(result > 0 && send_queue.size() > 0);
+        if (result == 0)
+            break;
+        consumeSendQueue(result);
+        statistics.bytes_sent += result;
+    }
     
-    return send_queue.size() > 0;
+    return send_queue_size > 0;
 }
 
 }//namespace network
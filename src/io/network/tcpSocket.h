@@ -4,6 +4,8 @@
 #include <io/network/address.h>
 #include <io/network/socketBase.h>
 #include <io/dataBuffer.h>
+#include <deque>
+#include <memory>
 
 
 namespace sp {
@@ -14,6 +16,19 @@ namespace network {
 class TcpSocket : public SocketBase
 {
 public:
+    struct Statistics
+    {
+        uint64_t bytes_sent = 0;        //Bytes handed to the OS, including framing.
+        uint64_t bytes_received = 0;
+        uint64_t frames_sent = 0;       //DataBuffers send or queued.
+        uint64_t frames_received = 0;
+        size_t peak_send_queue_size = 0;
+    };
+
+    //A complete frame, length prefix and data, that can be queued on many sockets without copying it.
+    using SharedFrame = std::shared_ptr<const std::string>;
+    static SharedFrame makeSharedFrame(const io::DataBuffer& buffer);
+
     TcpSocket();
     TcpSocket(TcpSocket&& socket);
     ~TcpSocket();
@@ -35,13 +50,39 @@ public:
     void queue(const io::DataBuffer& buffer);
     bool receive(io::DataBuffer& buffer);
 
+    //Queue a shared frame. Only a reference is kept, the data is send directly from the shared buffer.
+    void queue(const SharedFrame& frame);
+
     //Returns true if there is still data in the queue after sending
     bool sendSendQueue();
+
+    size_t getSendQueueSize() const { return send_queue_size; }
+    size_t getSendQueueStorage() const; //Bytes allocated for queued copies, including data already send from a segment that has not drained yet
+    const Statistics& getStatistics() const { return statistics; }
 private:
-    
+    //The send queue is a list of segments: data copied into the queue, or references to shared frames.
+    struct QueuedData
+    {
+        SharedFrame shared;
+        std::string owned;
+        size_t offset = 0;
+
+        const char* data() const { return shared ? shared->data() : owned.data(); }
+        size_t size() const { return shared ? shared->size() : owned.size(); }
+    };
+    static constexpr size_t max_send_segments = 64; //Segments handed to the OS in a single call
+
+    void appendFrame(const io::DataBuffer& buffer); //Length prefix and data, to the send queue
+    void appendToQueue(const void* data, size_t size);
+    void consumeSendQueue(size_t size);
+    void clearSendQueue();
+
     void* ssl_handle;
+    Statistics statistics;
 
-    std::string send_queue;
+    std::deque<QueuedData> send_queue;
+    size_t send_queue_size = 0;
+    std::string spare_queue_buffer; //Storage of the last fully send segment, reused for the next one
     uint32_t receive_packet_size{0};
     bool receive_packet_size_done{false};
     std::vector<uint8_t> receive_buffer;
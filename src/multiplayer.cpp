@@ -3,6 +3,7 @@
 #include "collisionable.h"
 #include "engine.h"
 #include "multiplayer_internal.h"
+#include "multiplayer_string_table.h"
 
 static PVector<Collisionable> collisionable_significant;
 class CollisionableReplicationData
@@ -28,6 +29,13 @@ MultiplayerObject::MultiplayerObject(string multiplayerClassIdentifier)
 {
     multiplayerObjectId = noId;
     replicated = false;
+    client_prediction = false;
+    replicate_all_members = false;
+    replication_thread_safe = true;
+    profiler_class_index = 0;
+    create_tick = 0;
+    replication_visibility_mask = multiplayerVisibleToAll;
+    replication_visibility_changed = false;
 
     if (game_server)
     {
@@ -62,6 +70,16 @@ template <> bool multiplayerReplicationFunctions<string>::isChanged(void* data,
     return false;
 }
 
+template <> void multiplayerReplicationFunctions<string>::sendData(void* data, sp::io::DataBuffer& packet)
+{
+    writeTableString(packet, *(string*)data);
+}
+
+template <> void multiplayerReplicationFunctions<string>::receiveData(void* data, sp::io::DataBuffer& packet)
+{
+    *(string*)data = readTableString(packet);
+}
+
 static bool collisionable_isChanged(void* data, void* prev_data_ptr)
 {
     CollisionableReplicationData* rep_data = *(CollisionableReplicationData**)prev_data_ptr;
@@ -173,11 +191,28 @@ void MultiplayerObject::registerCollisionableReplication(float object_significan
     info.prev_data = reinterpret_cast<std::uint64_t>(new CollisionableReplicationData());
     info.update_delay = 0.f;
     info.update_timeout = 0.f;
+    info.change_tick = 0;
     info.isChangedFunction = &collisionable_isChanged;
     info.sendFunction = &collisionable_sendFunction;
     info.receiveFunction = &collisionable_receiveFunction;
     info.cleanupFunction = &collisionable_cleanupFunction;
     memberReplicationInfo.push_back(info);
+    //The change check walks the shared list of significant objects.
+    replication_thread_safe = false;
+}
+
+void MultiplayerObject::setReplicationVisibilityMask(uint32_t mask)
+{
+    if (replication_visibility_mask == mask)
+        return;
+    replication_visibility_mask = mask;
+    replication_visibility_changed = true;
+}
+
+void MultiplayerObject::setReplicationVisibleClients(std::vector<int32_t> client_ids)
+{
+    replication_visible_clients = std::move(client_ids);
+    replication_visibility_changed = true;
 }
 
 void MultiplayerObject::sendClientCommand(sp::io::DataBuffer& packet)
@@ -187,10 +222,7 @@ void MultiplayerObject::sendClientCommand(sp::io::DataBuffer& packet)
         onReceiveClientCommand(0, packet);
     }else if (game_client)
     {
-        sp::io::DataBuffer p;
-        p << CMD_CLIENT_COMMAND << multiplayerObjectId;
-        game_client->sendPacket(p);
-        game_client->sendPacket(packet);
+        game_client->sendClientCommand(this, packet);
     }
 }
 
@@ -202,3 +234,11 @@ void MultiplayerObject::broadcastServerCommand(sp::io::DataBuffer& packet)
         game_server->broadcastServerCommandFromObject(multiplayerObjectId, packet);
     }
 }
+
+void MultiplayerObject::writeTableString(sp::io::DataBuffer& packet, const string& str)
+{
+    if (game_server && GameServer::isVisibilityRestricted(this))
+        packet << uint32_t(0) << str;
+    else
+        ::writeTableString(packet, str);
+}
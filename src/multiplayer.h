@@ -9,6 +9,8 @@
 
 class MultiplayerObject;
 
+static constexpr uint32_t multiplayerVisibleToAll = 0xFFFFFFFF; //Default visibility mask of objects and clients
+
 
 #define REGISTER_MULTIPLAYER_ENUM(type) \
     static inline sp::io::DataBuffer& operator << (sp::io::DataBuffer& packet, const type& e) { return packet << int8_t(e); } \
@@ -55,6 +57,9 @@ static inline sp::io::DataBuffer& operator >> (sp::io::DataBuffer& packet, sf::C
 
 template <typename T> struct multiplayerReplicationFunctions
 {
+    //Types with DataBuffer::writeArray/readArray, which produce the same data as writing each element.
+    static constexpr bool has_bulk_io = std::is_same<T, int32_t>::value || std::is_same<T, uint32_t>::value || std::is_same<T, float>::value;
+
     static bool isChanged(void* data, void* prev_data_ptr);
     static void sendData(void* data, sp::io::DataBuffer& packet)
     {
@@ -99,8 +104,11 @@ template <typename T> struct multiplayerReplicationFunctions
         std::vector<T>* ptr = (std::vector<T>*)data;
         uint16_t count = ptr->size();
         packet << count;
-        for(unsigned int n=0; n<count; n++)
-            packet << (*ptr)[n];
+        if constexpr (has_bulk_io)
+            packet.writeArray(ptr->data(), count);
+        else
+            for(unsigned int n=0; n<count; n++)
+                packet << (*ptr)[n];
     }
     static void receiveDataVector(void* data, sp::io::DataBuffer& packet)
     {
@@ -108,8 +116,11 @@ template <typename T> struct multiplayerReplicationFunctions
         uint16_t count;
         packet >> count;
         ptr->resize(count);
-        for(unsigned int n=0; n<count; n++)
-            packet >> (*ptr)[n];
+        if constexpr (has_bulk_io)
+            packet.readArray(ptr->data(), count);
+        else
+            for(unsigned int n=0; n<count; n++)
+                packet >> (*ptr)[n];
     }
     static void cleanupVector(void* prev_data_ptr)
     {
@@ -132,6 +143,9 @@ bool multiplayerReplicationFunctions<T>::isChanged(void* data, void* prev_data_p
 }
 
 template <> bool multiplayerReplicationFunctions<string>::isChanged(void* data, void* prev_data_ptr);
+//Replicated strings go through the string table of the server, so repeated values are send as an id.
+template <> void multiplayerReplicationFunctions<string>::sendData(void* data, sp::io::DataBuffer& packet);
+template <> void multiplayerReplicationFunctions<string>::receiveData(void* data, sp::io::DataBuffer& packet);
 
 //In between class that handles all the nasty synchronization of objects between server and client.
 //I'm assuming that it should be a pure virtual class though.
@@ -141,8 +155,24 @@ class MultiplayerObject : public virtual PObject
     int32_t multiplayerObjectId;
     bool replicated;
     bool on_server;
+    bool client_prediction;
+    bool replicate_all_members;
+    bool replication_thread_safe; //False when a member can only be serialized on the main thread (strings use the shared string table)
+    uint16_t profiler_class_index;
+    uint32_t create_tick; //Server replication tick at which the object was first send, for resuming clients
+    uint32_t replication_visibility_mask;
+    std::vector<int32_t> replication_visible_clients;
+    bool replication_visibility_changed;
     string multiplayerClassIdentifier;
 
+    struct PredictedClientCommand
+    {
+        uint32_t sequence;
+        std::vector<uint8_t> data;
+    };
+    std::vector<PredictedClientCommand> predicted_commands;
+    std::vector<uint8_t> prediction_base; //Client side: last authoritative value of all members, only filled while predicted commands are pending
+
     struct MemberReplicationInfo
     {
 #ifdef DEBUG
@@ -152,6 +182,7 @@ class MultiplayerObject : public virtual PObject
         uint64_t prev_data;
         float update_delay;
         float update_timeout;
+        uint32_t change_tick; //Server replication tick at which this member was last send
 
         bool(*isChangedFunction)(void* data, void* prev_data_ptr);
         void(*sendFunction)(void* data, sp::io::DataBuffer& packet);
@@ -195,11 +226,14 @@ public:
         init_prev_data<T>(info);
         info.update_delay = update_delay;
         info.update_timeout = 0.0;
+        info.change_tick = 0;
         info.isChangedFunction = &multiplayerReplicationFunctions<T>::isChanged;
         info.sendFunction = &multiplayerReplicationFunctions<T>::sendData;
         info.receiveFunction = &multiplayerReplicationFunctions<T>::receiveData;
         info.cleanupFunction = NULL;
         memberReplicationInfo.push_back(info);
+        if (std::is_same<T, string>::value)
+            replication_thread_safe = false;
 #ifdef DEBUG
         if (multiplayerReplicationFunctions<T>::isChanged(member, &info.prev_data))
         {
@@ -219,11 +253,14 @@ public:
         info.prev_data = reinterpret_cast<std::uint64_t>(new std::vector<T>);
         info.update_delay = update_delay;
         info.update_timeout = 0.0;
+        info.change_tick = 0;
         info.isChangedFunction = &multiplayerReplicationFunctions<T>::isChangedVector;
         info.sendFunction = &multiplayerReplicationFunctions<T>::sendDataVector;
         info.receiveFunction = &multiplayerReplicationFunctions<T>::receiveDataVector;
         info.cleanupFunction = &multiplayerReplicationFunctions<T>::cleanupVector;
         memberReplicationInfo.push_back(info);
+        if (std::is_same<T, string>::value)
+            replication_thread_safe = false;
     }
 
     void registerMemberReplication_(F_PARAM glm::vec3* member, float update_delay = 0.0)
@@ -247,15 +284,36 @@ public:
                 memberReplicationInfo[n].update_timeout = 0.0;
     }
 
+    //Send all members at the next replication, also the ones that did not change or have an update delay.
+    void replicateAllMembers() { replicate_all_members = true; }
+
     void registerCollisionableReplication(float object_significant_range = -1);
 
+    //Enable client side prediction. Client commands for this object are applied locally with onPredictClientCommand as soon as they are send,
+    // and re-applied on top of every authoritative update of the object till the server acknowledges them. Should be called on both the server and the client.
+    void setClientPrediction(bool enabled) { client_prediction = enabled; }
+    bool hasClientPrediction() { return client_prediction; }
+
+    //Limit the clients this object is replicated to, only used on the server. The object is send to clients whose visibility mask
+    // (see GameServer::setClientVisibilityMask) shares a bit with this mask, or, with a client list set, only to those clients.
+    // A client that loses sight of the object gets it deleted, and created again once it can see it again.
+    void setReplicationVisibilityMask(uint32_t mask);
+    uint32_t getReplicationVisibilityMask() { return replication_visibility_mask; }
+    // Clients behind a GameServerProxy share one connection, they all get the objects that any of them can see.
+    void setReplicationVisibleClients(std::vector<int32_t> client_ids); //An empty list uses the visibility mask again
+    const std::vector<int32_t>& getReplicationVisibleClients() { return replication_visible_clients; }
+
     int32_t getMultiplayerId() { return multiplayerObjectId; }
     const string& getMultiplayerClassIdentifier() { return multiplayerClassIdentifier; }
     void sendClientCommand(sp::io::DataBuffer& packet);//Send a command from the client to the server.
     void broadcastServerCommand(sp::io::DataBuffer& packet);//Send a command from the server to all clients.
+    //writeTableString for the payload of commands of this object. Hides the global version in subclasses, as the string table
+    // definitions go to every client, strings of an object with restricted visibility are written in full.
+    void writeTableString(sp::io::DataBuffer& packet, const string& str);
 
     virtual void onReceiveClientCommand(int32_t client_id, sp::io::DataBuffer& packet) {} //Got data from a client, handle it.
     virtual void onReceiveServerCommand(sp::io::DataBuffer& packet) {} //Got data from a server, handle it.
+    virtual void onPredictClientCommand(sp::io::DataBuffer& packet) {} //Apply a not yet acknowledged client command locally, only called with client prediction enabled.
 private:
     friend class GameServer;
     friend class GameClient;
@@ -1,6 +1,7 @@
 #include "multiplayer_client.h"
 #include "multiplayer.h"
 #include "multiplayer_internal.h"
+#include "multiplayer_recorder.h"
 #include "engine.h"
 
 P<GameClient> game_client;
@@ -12,10 +13,43 @@ GameClient::GameClient(int version_number, sp::io::network::Address server, int
     assert(!game_client);
 
     client_id = -1;
+    session_token = 0;
+    session_resume_time = 0.0f;
+    received_tick = 0;
+    resuming = false;
+    resume_password_sent = false;
+    command_sequence = 0;
+    acked_command_sequence = 0;
+    receive_backlog_size = 0;
+    receive_time_budget = 0.0f;
+    receive_packet_budget = 0;
     game_client = this;
     status = ReadyToConnect;
 
     no_data_timeout.start(no_data_disconnect_time);
+    time_sync_send_timer.repeat(multiplayerTimeSyncInterval);
+}
+
+GameClient::GameClient(std::unique_ptr<ReplicationPlayback> playback)
+: version_number(0), port_nr(0), playback(std::move(playback))
+{
+    assert(!game_server);
+    assert(!game_client);
+
+    client_id = -1;
+    session_token = 0;
+    session_resume_time = 0.0f;
+    received_tick = 0;
+    resuming = false;
+    resume_password_sent = false;
+    command_sequence = 0;
+    acked_command_sequence = 0;
+    receive_backlog_size = 0;
+    receive_time_budget = 0.0f;
+    receive_packet_budget = 0;
+    game_client = this;
+    status = Connected;
+    disconnect_reason = DisconnectReason::None;
 }
 
 GameClient::~GameClient()
@@ -33,14 +67,38 @@ P<MultiplayerObject> GameClient::getObjectById(int32_t id)
 
 void GameClient::update(float /*delta*/)
 {
+    if (playback)
+    {
+        playback->update();
+        if (playback->takeReset())
+        {
+            //Seeked, the keyframe we are about to receive recreates the whole world.
+            clearWorld();
+            receive_backlog.clear();
+            receive_backlog_size = 0;
+        }
+    }
     if (status == ReadyToConnect)
     {
         status = Connecting;
+        if (connect_thread.joinable())
+            connect_thread.join();
+        no_data_timeout.start(no_data_disconnect_time);
         connect_thread = std::move(std::thread(&GameClient::runConnect, this));
     }
     if (status == Disconnected || status == Connecting)
         return;
 
+    //Commands issued since the last update go out as a single frame, once connected.
+    flushClientCommands();
+
+    if (status == Connected && !playback && time_sync_send_timer.isExpired())
+    {
+        sp::io::DataBuffer time_sync;
+        time_sync << CMD_TIME_SYNC << NetworkTiming::now();
+        socket.send(time_sync);
+    }
+
     std::vector<int32_t> delList;
     for(std::unordered_map<int32_t, P<MultiplayerObject> >::iterator i=objectMap.begin(); i != objectMap.end(); i++)
     {
@@ -52,14 +110,40 @@ void GameClient::update(float /*delta*/)
     for(unsigned int n=0; n<delList.size(); n++)
         objectMap.erase(delList[n]);
 
+    //Take everything that arrived into the backlog. Keep alives and time syncs are answered right away,
+    // so the budget below does not show up as network latency.
     sp::io::DataBuffer reply;
     sp::io::DataBuffer packet;
-    while(socket.receive(packet))
+    while(receive_backlog_size < max_receive_backlog_size && receivePacket(packet))
     {
         no_data_timeout.start(no_data_disconnect_time);
 
         command_t command;
         packet >> command;
+        if (handleControlPacket(command, packet))
+            continue;
+        receive_backlog_size += packet.getDataSize();
+        receive_backlog.push_back({command, std::move(packet), NetworkTiming::now()});
+        packet.clear();
+    }
+
+    sp::SystemStopwatch apply_time;
+    receive_statistics.applied_packets = 0;
+    while(!receive_backlog.empty())
+    {
+        if ((receive_packet_budget > 0 && receive_statistics.applied_packets >= receive_packet_budget) ||
+            (receive_time_budget > 0.0f && apply_time.get() >= receive_time_budget))
+        {
+            receive_statistics.budget_exceeded_count++;
+            break;
+        }
+        ReceivedPacket received = std::move(receive_backlog.front());
+        receive_backlog.pop_front();
+        receive_backlog_size -= received.packet.getDataSize();
+        receive_statistics.applied_packets++;
+
+        command_t command = received.command;
+        sp::io::DataBuffer& packet = received.packet;
         switch(status)
         {
         case ReadyToConnect:
@@ -83,24 +167,39 @@ void GameClient::update(float /*delta*/)
 
                     if (!require_password)
                     {
-                        reply.clear();
-                        reply << CMD_CLIENT_SEND_AUTH << int32_t(version_number) << string("");
-                        socket.send(reply);
+                        sendAuth("");
+                    }else if (resuming && !resume_password_sent && password != ""){
+                        //Resuming, use the password that was accepted before. Ask again if it is not accepted anymore.
+                        resume_password_sent = true;
+                        sendAuth(password);
+                        status = Authenticating;
                     }else{
                         status = WaitingForPassword;
                     }
                 }
                 break;
             case CMD_SET_CLIENT_ID:
-                packet >> client_id;
-                status = Connected;
-                disconnect_reason = DisconnectReason::None;
-                break;
-            case CMD_ALIVE:
-                // send response to calculate ping
-                reply.clear();
-                reply << CMD_ALIVE_RESP;
-                socket.send(reply);
+                {
+                    uint32_t token_high = 0;
+                    uint32_t token_low = 0;
+                    float resume_time = 0.0f;
+                    bool resumed = false;
+                    packet >> client_id;
+                    if (packet.available())
+                        packet >> token_high >> token_low >> resume_time >> resumed;
+                    if (resuming && !resumed)
+                    {
+                        //The server could not resume our session and sends the whole world again.
+                        LOG(INFO) << "GameClient: Session not resumed, receiving the world again";
+                        clearWorld();
+                    }
+                    session_token = (uint64_t(token_high) << 32) | token_low;
+                    session_resume_time = resume_time;
+                    resuming = false;
+                    resume_password_sent = false;
+                    status = Connected;
+                    disconnect_reason = DisconnectReason::None;
+                }
                 break;
             default:
                 LOG(ERROR) << "Unknown command from server: " << command;
@@ -112,8 +211,8 @@ void GameClient::update(float /*delta*/)
             case CMD_CREATE:
                 {
                     int32_t id;
-                    string name;
-                    packet >> id >> name;
+                    packet >> id;
+                    string name = string_table.read(packet);
                     if (objectMap.find(id) == objectMap.end() || !objectMap[id])
                     {
                         for(MultiplayerClassListItem* i = multiplayerClassListStart; i; i = i->next)
@@ -124,16 +223,7 @@ void GameClient::update(float /*delta*/)
                                 MultiplayerObject* obj = i->func();
                                 obj->multiplayerObjectId = id;
                                 objectMap[id] = obj;
-
-                                while(packet.available())
-                                {
-                                    int16_t idx;
-                                    packet >> idx;
-                                    if (idx >= 0 && idx < int16_t(obj->memberReplicationInfo.size()))
-                                        (obj->memberReplicationInfo[idx].receiveFunction)(obj->memberReplicationInfo[idx].ptr, packet);
-                                    else
-                                        LOG(DEBUG) << "Odd index from server replication: " << idx;
-                                }
+                                receiveMembers(obj, packet);
                             }
                         }
                     }
@@ -150,16 +240,19 @@ void GameClient::update(float /*delta*/)
             case CMD_UPDATE_VALUE:
                 {
                     int32_t id;
-                    int16_t idx;
                     packet >> id;
                     if (objectMap.find(id) != objectMap.end() && objectMap[id])
                     {
                         P<MultiplayerObject> obj = objectMap[id];
-                        while(packet.available())
+                        //Members of a predicted object hold the predictions, the update applies to the authoritative state instead.
+                        bool predicted = obj->client_prediction && !obj->predicted_commands.empty();
+                        if (predicted)
+                            restorePredictionBase(*obj);
+                        receiveMembers(*obj, packet);
+                        if (predicted)
                         {
-                            packet >> idx;
-                            if (idx < int32_t(obj->memberReplicationInfo.size()))
-                                (obj->memberReplicationInfo[idx].receiveFunction)(obj->memberReplicationInfo[idx].ptr, packet);
+                            storePredictionBase(*obj);
+                            replayPredictedCommands(*obj);
                         }
                     }
                 }
@@ -193,10 +286,8 @@ void GameClient::update(float /*delta*/)
                 {
                     int32_t id = 0;
                     packet >> id;
-                    const unsigned char* ptr = reinterpret_cast<const unsigned char*>(packet.getData());
-                    ptr += sizeof(command_t) + sizeof(int32_t);
-                    int32_t size = static_cast<int>(packet.getDataSize()) - sizeof(command_t) - sizeof(int32_t);
-                    audio_stream_manager.receivedPacketFromNetwork(id, ptr, size);
+                    auto payload = packet.getView();
+                    audio_stream_manager.receivedPacketFromNetwork(id, static_cast<const unsigned char*>(payload.getRemainingData()), static_cast<int>(payload.available()));
                 }
                 break;
             case CMD_AUDIO_COMM_STOP:
@@ -206,11 +297,17 @@ void GameClient::update(float /*delta*/)
                     audio_stream_manager.stop(id);
                 }
                 break;
-            case CMD_ALIVE:
-                // send response to calculate ping
-                reply.clear();
-                reply << CMD_ALIVE_RESP;
-                socket.send(reply);
+            case CMD_CLIENT_COMMAND_ACK:
+                packet >> acked_command_sequence;
+                reconcilePredictedCommands();
+                break;
+            case CMD_STRING_TABLE_SET:
+                {
+                    uint32_t id = 0;
+                    string value;
+                    packet >> id >> value;
+                    string_table.define(id, value);
+                }
                 break;
             default:
                 LOG(ERROR) << "Unknown command from server: " << command;
@@ -220,8 +317,23 @@ void GameClient::update(float /*delta*/)
         }
     }
 
+    if (playback)
+        return;
     if (!socket.isConnected() || no_data_timeout.isExpired())
     {
+        //Reconnect to resume the session, once everything received on the old connection is applied.
+        if (status == Connected && session_token != 0)
+        {
+            socket.close();
+            if (receive_backlog.empty())
+            {
+                LOG(INFO) << "GameClient: Connection lost, resuming session of client " << client_id << " from tick " << received_tick;
+                resuming = true;
+                resume_timeout.start(session_resume_time);
+                status = ReadyToConnect;
+            }
+            return;
+        }
         if (disconnect_reason == DisconnectReason::None)
             disconnect_reason = socket.isConnected() ? DisconnectReason::TimedOut : DisconnectReason::ClosedByServer;
         socket.close();
@@ -229,22 +341,212 @@ void GameClient::update(float /*delta*/)
     }
 }
 
+bool GameClient::handleControlPacket(uint16_t command, sp::io::DataBuffer& packet)
+{
+    switch(command)
+    {
+    case CMD_ALIVE:
+        {
+            // send response to calculate ping
+            sp::io::DataBuffer reply;
+            reply << CMD_ALIVE_RESP;
+            socket.send(reply);
+        }
+        return true;
+    case CMD_TIME_SYNC:
+    case CMD_TIME_SYNC_RESP:
+        handleTimeSync(command, packet);
+        return true;
+    }
+    return false;
+}
+
+void GameClient::setReceiveBudget(float max_time, unsigned int max_packets)
+{
+    receive_time_budget = max_time;
+    receive_packet_budget = max_packets;
+}
+
+GameClient::ReceiveStatistics GameClient::getReceiveStatistics() const
+{
+    ReceiveStatistics result = receive_statistics;
+    result.backlog_packets = receive_backlog.size();
+    result.backlog_bytes = receive_backlog_size;
+    if (!receive_backlog.empty())
+        result.backlog_age = float(NetworkTiming::now() - receive_backlog.front().receive_time);
+    return result;
+}
+
 void GameClient::sendPacket(sp::io::DataBuffer& packet)
 {
     socket.send(packet);
 }
 
+void GameClient::sendClientCommand(P<MultiplayerObject> obj, sp::io::DataBuffer& packet)
+{
+    command_sequence++;
+
+    if (client_command_batch.getDataSize() == 0)
+        client_command_batch << CMD_CLIENT_COMMAND;
+    client_command_batch << obj->multiplayerObjectId << command_sequence << uint32_t(packet.getDataSize());
+    client_command_batch.appendRaw(packet.getData(), packet.getDataSize());
+    if (client_command_batch.getDataSize() >= max_client_command_batch_size)
+        flushClientCommands();
+
+    if (obj->client_prediction)
+    {
+        //Without pending commands the object holds the authoritative state, keep it to apply later updates to.
+        if (obj->predicted_commands.empty())
+            storePredictionBase(*obj);
+        const uint8_t* data = static_cast<const uint8_t*>(packet.getData());
+        obj->predicted_commands.push_back({command_sequence, std::vector<uint8_t>(data, data + packet.getDataSize())});
+        if (!predicted_objects.has(obj))
+            predicted_objects.push_back(obj);
+        obj->onPredictClientCommand(packet);
+    }
+}
+
+void GameClient::handleTimeSync(uint16_t command, sp::io::DataBuffer& packet)
+{
+    if (command == CMD_TIME_SYNC)
+    {
+        double server_time = 0.0;
+        packet >> server_time;
+        //The server adds its replication tick when everything up to that tick was send before this packet.
+        if (packet.available())
+            packet >> received_tick;
+        sp::io::DataBuffer reply;
+        reply << CMD_TIME_SYNC_RESP << server_time << NetworkTiming::now();
+        if (session_token != 0)
+            reply << received_tick;
+        socket.send(reply);
+    }else{
+        double send_time = 0.0;
+        double server_time = 0.0;
+        packet >> send_time >> server_time;
+        timing.addSample(send_time, server_time, NetworkTiming::now());
+    }
+}
+
+void GameClient::flushClientCommands()
+{
+    //The server only accepts commands once authenticated, while (re)connecting they are kept till then.
+    if (client_command_batch.getDataSize() == 0 || status != Connected || (!playback && !socket.isConnected()))
+        return;
+    socket.send(client_command_batch);
+    client_command_batch.clear();
+}
+
+void GameClient::receiveMembers(MultiplayerObject* obj, sp::io::DataBuffer& packet)
+{
+    while(packet.available())
+    {
+        int16_t idx;
+        uint32_t size;
+        packet >> idx >> size;
+        if (idx >= 0 && idx < int16_t(obj->memberReplicationInfo.size()))
+        {
+            (obj->memberReplicationInfo[idx].receiveFunction)(obj->memberReplicationInfo[idx].ptr, packet);
+        }else{
+            LOG(DEBUG) << "Odd index from server replication: " << idx;
+            sp::io::DataView skipped;
+            packet.readView(skipped, size >> 1);
+        }
+    }
+}
+
+void GameClient::reconcilePredictedCommands()
+{
+    foreach(MultiplayerObject, obj, predicted_objects)
+    {
+        auto& commands = obj->predicted_commands;
+        auto acked_end = std::find_if(commands.begin(), commands.end(), [this](const MultiplayerObject::PredictedClientCommand& command) { return command.sequence > acked_command_sequence; });
+        if (acked_end == commands.begin())
+            continue;
+        commands.erase(commands.begin(), acked_end);
+
+        //The server sends the full state of an object to us before acknowledging commands for it,
+        // so the base now holds the authoritative state and only what the server has not seen yet is re-applied.
+        restorePredictionBase(*obj);
+        if (commands.empty())
+            obj->prediction_base = {};
+        else
+            replayPredictedCommands(*obj);
+    }
+    predicted_objects.erase(std::remove_if(predicted_objects.begin(), predicted_objects.end(), [](const P<MultiplayerObject>& obj) { return !obj || obj->predicted_commands.empty(); }), predicted_objects.end());
+}
+
+void GameClient::storePredictionBase(MultiplayerObject* obj)
+{
+    sp::io::DataBuffer base;
+    for(unsigned int n=0; n<obj->memberReplicationInfo.size(); n++)
+    {
+        base << int16_t(n);
+        (obj->memberReplicationInfo[n].sendFunction)(obj->memberReplicationInfo[n].ptr, base);
+    }
+    auto data = static_cast<const uint8_t*>(base.getData());
+    obj->prediction_base.assign(data, data + base.getDataSize());
+}
+
+void GameClient::restorePredictionBase(MultiplayerObject* obj)
+{
+    sp::io::DataBuffer packet;
+    packet.appendRaw(obj->prediction_base.data(), obj->prediction_base.size());
+    while(packet.available())
+    {
+        int16_t idx;
+        packet >> idx;
+        (obj->memberReplicationInfo[idx].receiveFunction)(obj->memberReplicationInfo[idx].ptr, packet);
+    }
+}
+
+void GameClient::replayPredictedCommands(MultiplayerObject* obj)
+{
+    for(auto& command : obj->predicted_commands)
+    {
+        sp::io::DataBuffer packet;
+        packet.appendRaw(command.data.data(), command.data.size());
+        obj->onPredictClientCommand(packet);
+    }
+}
+
+bool GameClient::receivePacket(sp::io::DataBuffer& packet)
+{
+    if (playback)
+        return playback->receive(packet);
+    return socket.receive(packet);
+}
+
 void GameClient::sendPassword(string password)
 {
     if (status != WaitingForPassword)
         return;
 
     disconnect_reason = DisconnectReason::BadCredentials;
+    this->password = password;
+    sendAuth(password);
+    
+    status = Authenticating;
+}
+
+void GameClient::sendAuth(const string& password)
+{
     sp::io::DataBuffer reply;
     reply << CMD_CLIENT_SEND_AUTH << int32_t(version_number) << password;
+    //Ask to continue the previous session, the server gives us a new client id and the full world when it cannot.
+    if (resuming)
+        reply << client_id << uint32_t(session_token >> 32) << uint32_t(session_token) << received_tick;
     socket.send(reply);
-    
-    status = Authenticating;
+}
+
+void GameClient::clearWorld()
+{
+    for(auto& it : objectMap)
+        if (it.second)
+            it.second->destroy();
+    objectMap.clear();
+    string_table.clear();
+    received_tick = 0;
 }
 
 void GameClient::runConnect()
@@ -253,6 +555,12 @@ void GameClient::runConnect()
     {
         LOG(INFO) << "GameClient: Connected, waiting for authentication";
         status = Authenticating;
+    }else if (resuming && resume_timeout.getTimeLeft() > 0.0f){
+        //The network might not be back yet, keep trying while the server still keeps our session.
+        LOG(INFO) << "GameClient: Failed to reconnect, retrying";
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        status = ReadyToConnect;
+        return;
     }else{
         LOG(INFO) << "GameClient: Failed to connect";
         status = Disconnected;
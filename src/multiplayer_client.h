@@ -8,17 +8,21 @@
 #include "timer.h"
 
 #include <stdint.h>
+#include <deque>
 #include <thread>
 
 
 class GameClient;
 class MultiplayerObject;
+class ReplicationPlayback;
 
 extern P<GameClient> game_client;
 
 class GameClient : public Updatable
 {
     constexpr static float no_data_disconnect_time = 20;
+    constexpr static unsigned int max_client_command_batch_size = 16 * 1024;
+    constexpr static size_t max_receive_backlog_size = 4 * 1024 * 1024; //Above this, leave the data in the socket so the server sees we are behind
 public:
     enum Status
     {
@@ -39,6 +43,15 @@ public:
         ClosedByServer, // Normal termination.
         Unknown
     };
+
+    struct ReceiveStatistics
+    {
+        size_t backlog_packets = 0;     //Received packets waiting to be applied.
+        size_t backlog_bytes = 0;
+        float backlog_age = 0.0f;       //Seconds the oldest waiting packet has been waiting, how far behind the server we are.
+        unsigned int applied_packets = 0;   //Packets applied in the last update.
+        uint32_t budget_exceeded_count = 0; //Updates that ran out of budget before the backlog was empty.
+    };
 private:
     int version_number;
     sp::io::network::Address server;
@@ -50,25 +63,88 @@ private:
     Status status;
     sp::SystemTimer no_data_timeout;
     NetworkAudioStreamManager audio_stream_manager;
+    NetworkTiming timing;
+    sp::SystemTimer time_sync_send_timer;
 
     std::thread connect_thread;
     DisconnectReason disconnect_reason{ DisconnectReason::Unknown };
+
+    std::unique_ptr<ReplicationPlayback> playback;
+    ReplicationStringTable string_table;
+
+    uint64_t session_token;         //Given by the server when it allows resuming, 0 otherwise
+    float session_resume_time;      //How long the server keeps our session after the connection drops
+    uint32_t received_tick;         //Last server replication tick we received everything of
+    bool resuming;
+    bool resume_password_sent;
+    string password;
+    sp::SystemTimer resume_timeout;
+
+    uint32_t command_sequence;
+    uint32_t acked_command_sequence;
+    sp::io::DataBuffer client_command_batch;
+    PVector<MultiplayerObject> predicted_objects;
+
+    struct ReceivedPacket
+    {
+        uint16_t command;
+        sp::io::DataBuffer packet;
+        double receive_time;
+    };
+    std::deque<ReceivedPacket> receive_backlog;
+    size_t receive_backlog_size;
+    float receive_time_budget;
+    unsigned int receive_packet_budget;
+    ReceiveStatistics receive_statistics;
 public:
     GameClient(int version_number, sp::io::network::Address server, int port_nr = defaultServerPort);
+    //Play back a recording made with GameServer::startRecording instead of connecting to a server.
+    GameClient(std::unique_ptr<ReplicationPlayback> playback);
     virtual ~GameClient();
 
     P<MultiplayerObject> getObjectById(int32_t id);
     virtual void update(float delta);
 
     int32_t getClientId() { return client_id; }
+    //When the server allows it, a lost connection is reconnected and the session resumed, keeping the client id and the world.
+    // While resuming, the status goes through Connecting and Authenticating again. If the server cannot resume, the world is received anew.
     Status getStatus() { return status; }
+    bool isResuming() { return resuming; }
     DisconnectReason getDisconnectReason() const { return disconnect_reason; }
 
+    float getRoundTripTime() const { return timing.getRoundTripTime(); }
+    float getJitter() const { return timing.getJitter(); }
+    double getClockOffset() const { return timing.getClockOffset(); } //Server clock minus client clock, in seconds
+    double getServerTime() const { return NetworkTiming::now() + timing.getClockOffset(); } //Estimate of GameServer::getServerTime
+
+    //Limit the time and the number of packets spend on applying replication in a single update, the remainder is applied in the next updates.
+    // This spreads out large bursts, like the world on joining, over multiple frames. Zero disables a limit, both are disabled by default.
+    void setReceiveBudget(float max_time, unsigned int max_packets);
+    ReceiveStatistics getReceiveStatistics() const;
+
     void sendPacket(sp::io::DataBuffer& packet);
 
     void sendPassword(string password);
+
+    ReplicationPlayback* getPlayback() { return playback.get(); }
+    const ReplicationStringTable& getStringTable() const { return string_table; }
 private:
     void runConnect();
+    void sendAuth(const string& password);
+    void clearWorld();
+    bool receivePacket(sp::io::DataBuffer& packet);
+    bool handleControlPacket(uint16_t command, sp::io::DataBuffer& packet);
+
+    void sendClientCommand(P<MultiplayerObject> obj, sp::io::DataBuffer& packet);
+    void flushClientCommands();
+    void handleTimeSync(uint16_t command, sp::io::DataBuffer& packet);
+    void reconcilePredictedCommands();
+    void receiveMembers(MultiplayerObject* obj, sp::io::DataBuffer& packet); //Members of CMD_CREATE and CMD_UPDATE_VALUE
+    void storePredictionBase(MultiplayerObject* obj);
+    void restorePredictionBase(MultiplayerObject* obj);
+    void replayPredictedCommands(MultiplayerObject* obj);
+
+    friend class MultiplayerObject;
 };
 
 #endif//MULTIPLAYER_CLIENT_H
@@ -3,6 +3,9 @@
 
 //Definitions shared between different SeriousProton multiplayer objects, but do not need to be exported outside the engine.
 typedef uint16_t command_t;
+//CMD_CREATE and CMD_UPDATE_VALUE hold members as [index:int16][size << 1 | table string:uint32][data of the send function].
+// With the size a member can be skipped or stored without decoding it, like the world cache of a proxy does. The lowest bit marks
+// strings written through the string table, their id can be redefined later, so a stored value needs the string resolved.
 static const command_t CMD_CREATE = 0x0001;
 static const command_t CMD_UPDATE_VALUE = 0x0002;
 static const command_t CMD_DELETE = 0x0003;
@@ -20,6 +23,10 @@ static const command_t CMD_SERVER_CONNECT_TO_PROXY = 0x000f;
 static const command_t CMD_CLIENT_SEND_AUTH = 0x0010;
 static const command_t CMD_SERVER_COMMAND = 0x0011;
 static const command_t CMD_ALIVE_RESP = 0x0012;
+static const command_t CMD_CLIENT_COMMAND_ACK = 0x0013;
+static const command_t CMD_TIME_SYNC = 0x0014;
+static const command_t CMD_TIME_SYNC_RESP = 0x0015;
+static const command_t CMD_STRING_TABLE_SET = 0x0016;
 
 static const command_t CMD_AUDIO_COMM_START = 0x0020;
 static const command_t CMD_AUDIO_COMM_DATA = 0x0021;
@@ -0,0 +1,200 @@
+#include "multiplayer_lockstep.h"
+#include "random.h"
+#include <algorithm>
+
+
+LockstepObject::LockstepObject(string multiplayerClassIdentifier, float tick_rate)
+: MultiplayerObject(multiplayerClassIdentifier)
+{
+    lockstep_tick = 0;
+    tick_delta = 1.0f / tick_rate;
+    random_state = uint32_t(irandom(1, 0x7FFFFFFF));
+    executed_tick = 0;
+    broadcast_tick = 0;
+    synced_tick = 0;
+    synced = false;
+    tick_time = 0.0f;
+    checksum_interval = defaultChecksumInterval;
+    input_delay = defaultInputDelay;
+    last_resync_tick = 0;
+
+    registerLockstepState(&lockstep_tick);
+    registerLockstepState(&tick_delta);
+    registerLockstepState(&random_state);
+}
+
+void LockstepObject::update(float delta)
+{
+    if (isServer())
+    {
+        tick_time += delta;
+        for(int n=0; n<maxTicksPerUpdate && tick_time >= tick_delta; n++)
+        {
+            tick_time -= tick_delta;
+            broadcastTick(++broadcast_tick);
+        }
+        //Do not build up a backlog after a stall, the clients would have to catch up on all of it.
+        tick_time = std::min(tick_time, tick_delta);
+    }
+    else if (!synced || lockstep_tick != synced_tick)
+    {
+        //New state from the server, on creation or after a resync. Continue from the tick it belongs to.
+        synced = true;
+        synced_tick = lockstep_tick;
+        executed_tick = lockstep_tick;
+        received_ticks.erase(received_ticks.begin(), received_ticks.upper_bound(executed_tick));
+    }
+    runReceivedTicks();
+}
+
+void LockstepObject::sendLockstepInput(sp::io::DataBuffer& input)
+{
+    sp::io::DataBuffer packet;
+    packet << uint8_t(ClientCommand::Input) << uint32_t(executed_tick + input_delay) << uint32_t(input.getDataSize());
+    packet.appendRaw(input.getData(), input.getDataSize());
+    sendClientCommand(packet);
+}
+
+uint32_t LockstepObject::lockstepRandom()
+{
+    //xorshift32, simple and the same on every platform.
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+float LockstepObject::lockstepRandom(float min, float max)
+{
+    return min + (max - min) * float(lockstepRandom() >> 8) / float(1 << 24);
+}
+
+int LockstepObject::lockstepRandom(int min, int max)
+{
+    return min + int(lockstepRandom() % uint32_t(max - min + 1));
+}
+
+void LockstepObject::resyncLockstepState()
+{
+    if (!isServer())
+        return;
+    last_resync_tick = executed_tick;
+    replicateAllMembers();
+}
+
+void LockstepObject::onReceiveClientCommand(int32_t client_id, sp::io::DataBuffer& packet)
+{
+    uint8_t command = 0;
+    uint32_t tick = 0;
+    packet >> command >> tick;
+    switch(ClientCommand(command))
+    {
+    case ClientCommand::Input:
+        {
+            uint32_t size = 0;
+            sp::io::DataView data;
+            packet >> size;
+            if (!packet.readView(data, size))
+                break;
+            //Input for a tick that is already broadcast goes into the next one.
+            tick = std::max(tick, std::max(broadcast_tick, executed_tick) + 1);
+            LockstepInput input{client_id, sp::io::DataBuffer()};
+            input.data.appendRaw(data.getData(), data.getDataSize());
+            pending_inputs[tick].push_back(std::move(input));
+        }
+        break;
+    case ClientCommand::Checksum:
+        {
+            uint32_t checksum = 0;
+            packet >> checksum;
+            //Reports from before the last resync are expected to be wrong, the client did not have the new state yet.
+            if (tick <= last_resync_tick)
+                break;
+            auto it = checksums.find(tick);
+            if (it != checksums.end() && it->second != checksum)
+            {
+                LOG(WARNING) << "Lockstep desync of " << getMultiplayerClassIdentifier() << " with client " << client_id << " at tick " << tick << ", resyncing";
+                onLockstepDesync(client_id, tick);
+                resyncLockstepState();
+            }
+        }
+        break;
+    }
+}
+
+void LockstepObject::onReceiveServerCommand(sp::io::DataBuffer& packet)
+{
+    uint32_t tick = 0;
+    uint32_t count = 0;
+    packet >> tick >> count;
+    std::vector<LockstepInput> inputs;
+    inputs.reserve(count);
+    for(uint32_t n=0; n<count; n++)
+    {
+        int32_t client_id = 0;
+        uint32_t size = 0;
+        sp::io::DataView data;
+        packet >> client_id >> size;
+        if (!packet.readView(data, size))
+            break;
+        LockstepInput input{client_id, sp::io::DataBuffer()};
+        input.data.appendRaw(data.getData(), data.getDataSize());
+        inputs.push_back(std::move(input));
+    }
+    //Every tick is broadcast once, a tick that is already simulated or queued is never replaced.
+    if (tick <= executed_tick || received_ticks.find(tick) != received_ticks.end())
+        return;
+    received_ticks.emplace(tick, std::move(inputs));
+}
+
+void LockstepObject::broadcastTick(uint32_t tick)
+{
+    //All inputs for this tick, and any that are late, in a single deterministic order.
+    sp::io::DataBuffer packet;
+    auto end = pending_inputs.upper_bound(tick);
+    uint32_t count = 0;
+    for(auto it = pending_inputs.begin(); it != end; ++it)
+        count += it->second.size();
+    packet << tick << count;
+    for(auto it = pending_inputs.begin(); it != end; ++it)
+    {
+        for(auto& input : it->second)
+        {
+            packet << input.client_id << uint32_t(input.data.getDataSize());
+            packet.appendRaw(input.data.getData(), input.data.getDataSize());
+        }
+    }
+    pending_inputs.erase(pending_inputs.begin(), end);
+    //On the server this also lands in onReceiveServerCommand, so the server simulates the exact same input set.
+    broadcastServerCommand(packet);
+}
+
+void LockstepObject::runReceivedTicks()
+{
+    while(!received_ticks.empty() && received_ticks.begin()->first == executed_tick + 1)
+    {
+        auto it = received_ticks.begin();
+        executed_tick = it->first;
+        onLockstepTick(executed_tick, it->second);
+        received_ticks.erase(it);
+        if (isServer())
+            lockstep_tick = executed_tick;
+
+        if (checksum_interval > 0 && executed_tick % checksum_interval == 0)
+        {
+            uint32_t checksum = getLockstepChecksum();
+            if (isServer())
+            {
+                checksums[executed_tick] = checksum;
+                if (executed_tick > checksum_history_size)
+                    checksums.erase(checksums.begin(), checksums.lower_bound(executed_tick - checksum_history_size));
+            }
+            else
+            {
+                sp::io::DataBuffer packet;
+                packet << uint8_t(ClientCommand::Checksum) << executed_tick << checksum;
+                sendClientCommand(packet);
+            }
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef MULTIPLAYER_LOCKSTEP_H
+#define MULTIPLAYER_LOCKSTEP_H
+
+#include "multiplayer.h"
+#include "Updatable.h"
+#include <limits>
+#include <map>
+#include <vector>
+
+//Input from a single client for a lockstep tick. Client id 0 is the server itself.
+struct LockstepInput
+{
+    int32_t client_id;
+    sp::io::DataBuffer data;
+};
+
+//Object that is simulated in lockstep instead of replicated member by member.
+// Clients send their inputs with sendLockstepInput, the server collects them into a set per tick and broadcasts that set,
+// and the server and every client run onLockstepTick with the same inputs and a fixed delta. This only works if the simulation is fully deterministic:
+// use getLockstepDelta for time and lockstepRandom for randomness, and never depend on anything local, like the frame delta or the global random functions.
+// Every checksum interval the clients report getLockstepChecksum to the server. On a mismatch the server sends its full lockstep state
+// through the normal replication, and all clients continue from there.
+// The lockstep state has to be registered with registerLockstepState, this is only send on creation and on a resync.
+// Subclasses that override onReceiveClientCommand or onReceiveServerCommand need to call the LockstepObject version.
+class LockstepObject : public MultiplayerObject, public Updatable
+{
+public:
+    static constexpr float defaultTickRate = 20.0f;
+    static constexpr uint32_t defaultChecksumInterval = 20; //In ticks
+    static constexpr uint32_t defaultInputDelay = 2;        //In ticks
+    static constexpr int maxTicksPerUpdate = 10;            //The server does not catch up further than this after a stall
+
+    LockstepObject(string multiplayerClassIdentifier, float tick_rate = defaultTickRate);
+
+    virtual void update(float delta) override;
+
+    //Queue input for an upcoming tick. Can be called on the server and on clients.
+    void sendLockstepInput(sp::io::DataBuffer& input);
+
+    uint32_t getLockstepTick() { return executed_tick; } //Last simulated tick
+    float getLockstepDelta() { return tick_delta; }
+    void setChecksumInterval(uint32_t interval) { checksum_interval = interval; }
+    void setInputDelay(uint32_t delay) { input_delay = delay; }
+
+    //Deterministic random numbers, the same on the server and all clients.
+    uint32_t lockstepRandom();
+    float lockstepRandom(float min, float max);
+    int lockstepRandom(int min, int max); //Including max
+
+    //Send a full copy of the lockstep state to all clients at the next replication, on the server.
+    void resyncLockstepState();
+
+    virtual void onReceiveClientCommand(int32_t client_id, sp::io::DataBuffer& packet) override;
+    virtual void onReceiveServerCommand(sp::io::DataBuffer& packet) override;
+protected:
+    //Advance the simulation a single tick of getLockstepDelta seconds.
+    virtual void onLockstepTick(uint32_t tick, std::vector<LockstepInput>& inputs) = 0;
+    //Hash of the full lockstep state, used to detect clients that run out of sync.
+    virtual uint32_t getLockstepChecksum() = 0;
+    //Called on the server when a client reported a different checksum, right before the resync.
+    virtual void onLockstepDesync(int32_t client_id, uint32_t tick) {}
+
+    template<typename T> void registerLockstepState(T* member)
+    {
+        //A delay that never runs out, so the member is only send on creation and with resyncLockstepState.
+        registerMemberReplication(member, lockstep_state_update_delay);
+    }
+private:
+    static constexpr float lockstep_state_update_delay = std::numeric_limits<float>::max();
+    static constexpr size_t checksum_history_size = 1024; //In ticks
+    enum class ClientCommand : uint8_t
+    {
+        Input,
+        Checksum
+    };
+
+    void broadcastTick(uint32_t tick);
+    void runReceivedTicks();
+
+    //Replicated lockstep state of the base class itself
+    uint32_t lockstep_tick;     //Last simulated tick, as of the last resync on clients
+    float tick_delta;
+    uint32_t random_state;
+
+    uint32_t executed_tick;
+    uint32_t broadcast_tick;    //Server side: last tick that was broadcast
+    uint32_t synced_tick;       //Client side: lockstep_tick of the last state received from the server
+    bool synced;
+    float tick_time;
+    uint32_t checksum_interval;
+    uint32_t input_delay;
+    uint32_t last_resync_tick;
+    std::map<uint32_t, std::vector<LockstepInput>> pending_inputs;  //Server side: inputs per requested tick
+    std::map<uint32_t, std::vector<LockstepInput>> received_ticks;  //Input sets from the server, not simulated yet
+    std::map<uint32_t, uint32_t> checksums;                         //Server side: own checksum per tick
+};
+
+#endif//MULTIPLAYER_LOCKSTEP_H
@@ -0,0 +1,69 @@
+#include "multiplayer_profiler.h"
+#include "logging.h"
+
+void ReplicationProfiler::reset()
+{
+    for(auto& info : classes)
+    {
+        info.create = {};
+        info.update_overhead = {};
+        for(auto& member : info.members)
+            member = {};
+    }
+    deletes = {};
+}
+
+uint16_t ReplicationProfiler::internClass(const string& name)
+{
+    auto it = class_index.find(name);
+    if (it != class_index.end())
+        return it->second;
+    uint16_t index = uint16_t(classes.size());
+    classes.emplace_back();
+    classes.back().name = name;
+    class_index[name] = index;
+    return index;
+}
+
+void ReplicationProfiler::addMemberSlot(ClassStatistics& info, uint16_t member_index, const char* member_name)
+{
+    auto old_size = info.members.size();
+    info.members.resize(member_index + 1);
+    info.member_names.resize(member_index + 1);
+    for(auto n = old_size; n < info.members.size(); n++)
+        info.member_names[n] = string(int(n));
+    if (member_name)
+        info.member_names[member_index] = member_name;
+}
+
+uint64_t ReplicationProfiler::getTotalBytes() const
+{
+    uint64_t total = deletes.bytes;
+    for(auto& info : classes)
+    {
+        total += info.create.bytes + info.update_overhead.bytes;
+        for(auto& member : info.members)
+            total += member.bytes;
+    }
+    return total;
+}
+
+void ReplicationProfiler::logReport() const
+{
+    uint64_t total = std::max(getTotalBytes(), uint64_t(1));
+    LOG(INFO) << "Replication profile, total bytes: " << std::to_string(total);
+    for(auto& info : classes)
+    {
+        if (info.create.count)
+            LOG(INFO) << info.name << "::CREATE: " << std::to_string(info.create.bytes) << " (" << int(info.create.bytes * 100 / total) << "%) in " << std::to_string(info.create.count);
+        if (info.update_overhead.count)
+            LOG(INFO) << info.name << "::OVERHEAD: " << std::to_string(info.update_overhead.bytes) << " (" << int(info.update_overhead.bytes * 100 / total) << "%) in " << std::to_string(info.update_overhead.count);
+        for(unsigned int n=0; n<info.members.size(); n++)
+        {
+            if (info.members[n].count)
+                LOG(INFO) << info.name << "::" << info.member_names[n] << ": " << std::to_string(info.members[n].bytes) << " (" << int(info.members[n].bytes * 100 / total) << "%) in " << std::to_string(info.members[n].count);
+        }
+    }
+    if (deletes.count)
+        LOG(INFO) << "DELETE: " << std::to_string(deletes.bytes) << " (" << int(deletes.bytes * 100 / total) << "%) in " << std::to_string(deletes.count);
+}
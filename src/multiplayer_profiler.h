@@ -0,0 +1,64 @@
+#ifndef MULTIPLAYER_PROFILER_H
+#define MULTIPLAYER_PROFILER_H
+
+#include "stringImproved.h"
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+//Accounts the bytes the server replicates per object class, per replicated member and per create/update/delete.
+// Classes are interned once when an object registers, so recording is only a few array lookups and never allocates
+// once every class/member has been seen.
+class ReplicationProfiler
+{
+public:
+    struct Counter
+    {
+        uint64_t bytes = 0;
+        uint64_t count = 0;
+
+        void add(size_t size) { bytes += size; count++; }
+    };
+    struct ClassStatistics
+    {
+        string name;
+        Counter create;
+        Counter update_overhead; //Command and object id of update packets
+        std::vector<Counter> members; //Indexed by replication member index
+        std::vector<string> member_names;
+    };
+
+    void setEnabled(bool enabled) { this->enabled = enabled; }
+    bool isEnabled() const { return enabled; }
+    void reset();
+
+    uint16_t internClass(const string& name);
+
+    void addCreate(uint16_t class_index, size_t bytes) { if (enabled) classes[class_index].create.add(bytes); }
+    void addUpdateOverhead(uint16_t class_index, size_t bytes) { if (enabled) classes[class_index].update_overhead.add(bytes); }
+    void addMember(uint16_t class_index, uint16_t member_index, const char* member_name, size_t bytes)
+    {
+        if (!enabled)
+            return;
+        auto& info = classes[class_index];
+        if (member_index >= info.members.size())
+            addMemberSlot(info, member_index, member_name);
+        info.members[member_index].add(bytes);
+    }
+    void addDelete(size_t bytes) { if (enabled) deletes.add(bytes); }
+
+    const std::vector<ClassStatistics>& getClasses() const { return classes; }
+    const Counter& getDeletes() const { return deletes; }
+    uint64_t getTotalBytes() const;
+
+    void logReport() const;
+private:
+    void addMemberSlot(ClassStatistics& info, uint16_t member_index, const char* member_name);
+
+    bool enabled = false;
+    std::vector<ClassStatistics> classes;
+    std::unordered_map<string, uint16_t> class_index;
+    Counter deletes;
+};
+
+#endif//MULTIPLAYER_PROFILER_H
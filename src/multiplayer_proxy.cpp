@@ -34,6 +34,8 @@ GameServerProxy::GameServerProxy(sp::io::network::Address hostname, int hostPort
     }
 
     no_data_timeout.start(noDataDisconnectTime);
+    time_sync_send_timer.repeat(multiplayerTimeSyncInterval);
+    statisticsLogTimer.repeat(statisticsLogInterval);
 }
 
 GameServerProxy::GameServerProxy(string password, int listenPort, string proxyName)
@@ -57,6 +59,8 @@ GameServerProxy::GameServerProxy(string password, int listenPort, string proxyNa
     }
 
     no_data_timeout.start(noDataDisconnectTime);
+    time_sync_send_timer.repeat(multiplayerTimeSyncInterval);
+    statisticsLogTimer.repeat(statisticsLogInterval);
 }
 
 GameServerProxy::~GameServerProxy()
@@ -78,6 +82,7 @@ void GameServerProxy::update(float delta)
         while(mainSocket->receive(packet))
         {
             no_data_timeout.start(noDataDisconnectTime);
+            statistics.frames_received++;
             command_t command;
             packet >> command;
             switch(command)
@@ -87,14 +92,32 @@ void GameServerProxy::update(float delta)
                     bool requirePassword;
                     packet >> serverVersion >> requirePassword;
 
+                    //No session to resume, and mark the connection as a proxy, so it is not taken for a player.
                     sp::io::DataBuffer reply;
-                    reply << CMD_CLIENT_SEND_AUTH << int32_t(serverVersion) << string(password);
+                    reply << CMD_CLIENT_SEND_AUTH << int32_t(serverVersion) << string(password) << int32_t(-1) << uint32_t(0) << uint32_t(0) << uint32_t(0) << true;
                     mainSocket->send(reply);
                 }
                 break;
             case CMD_SET_CLIENT_ID:
                 packet >> clientId;
                 break;
+            case CMD_TIME_SYNC:
+                {
+                    double serverTime = 0.0;
+                    packet >> serverTime;
+                    sp::io::DataBuffer reply;
+                    reply << CMD_TIME_SYNC_RESP << serverTime << NetworkTiming::now();
+                    mainSocket->send(reply);
+                }
+                break;
+            case CMD_TIME_SYNC_RESP:
+                {
+                    double sendTime = 0.0;
+                    double serverTime = 0.0;
+                    packet >> sendTime >> serverTime;
+                    server_timing.addSample(sendTime, serverTime, NetworkTiming::now());
+                }
+                break;
             case CMD_ALIVE:
                 {
                     sp::io::DataBuffer reply;
@@ -103,14 +126,21 @@ void GameServerProxy::update(float delta)
                 }
                 sendAll(packet);
                 break;
+            case CMD_AUDIO_COMM_DATA:
+                sendAll(packet, true);
+                break;
             case CMD_CREATE:
             case CMD_DELETE:
             case CMD_UPDATE_VALUE:
             case CMD_SET_GAME_SPEED:
+            case CMD_STRING_TABLE_SET:
+                worldCache.receive(command, packet);
+                sendAll(packet);
+                break;
             case CMD_SERVER_COMMAND:
             case CMD_AUDIO_COMM_START:
-            case CMD_AUDIO_COMM_DATA:
             case CMD_AUDIO_COMM_STOP:
+            case CMD_CLIENT_COMMAND_ACK:
                 sendAll(packet);
                 break;
             case CMD_PROXY_TO_CLIENTS:
@@ -127,6 +157,30 @@ void GameServerProxy::update(float delta)
                 {
                     int32_t tempId, proxied_clientId;
                     packet >> tempId >> proxied_clientId;
+                    auto pending = pendingProxiedClients.find(tempId);
+                    if (pending != pendingProxiedClients.end())
+                    {
+                        //Client of a chained proxy, pass the id on with the temporary id that proxy used.
+                        ClientInfo* proxy = nullptr;
+                        for(auto& info : clientList)
+                            if (info.validClient && info.socket && info.clientId == pending->second.proxyClientId)
+                                proxy = &info;
+                        if (proxy)
+                        {
+                            proxy->proxiedIds.insert(proxied_clientId);
+                            sp::io::DataBuffer proxied_packet;
+                            proxied_packet << CMD_SET_PROXY_CLIENT_ID << pending->second.tempId << proxied_clientId;
+                            proxy->socket->queue(proxied_packet);
+                        }
+                        else
+                        {
+                            sp::io::DataBuffer serverUpdate;
+                            serverUpdate << CMD_DEL_PROXY_CLIENT << proxied_clientId;
+                            mainSocket->send(serverUpdate);
+                        }
+                        pendingProxiedClients.erase(pending);
+                        break;
+                    }
                     for(auto& info : clientList)
                     {
                         if (!info.validClient && info.clientId == tempId)
@@ -137,14 +191,37 @@ void GameServerProxy::update(float delta)
                             {
                                 sp::io::DataBuffer proxied_packet;
                                 proxied_packet << CMD_SET_CLIENT_ID << info.clientId;
-                                info.socket->send(proxied_packet);
+                                info.socket->queue(proxied_packet);
+                            }
+                            if (info.worldFromCache)
+                            {
+                                if (worldCache.isValid())
+                                {
+                                    worldCache.queueSnapshot(*info.socket);
+                                }
+                                else
+                                {
+                                    //The cache broke down after the server was told not to send the world, the client has to reconnect.
+                                    LOG(WARNING) << "No world available for proxy client " << info.clientId << ", disconnecting";
+                                    info.socket->close();
+                                    continue;
+                                }
                             }
+                            info.socket->sendSendQueue();
                         }
                     }
                 }
                 break;
             }
         }
+        if (statisticsLogTimer.isExpired())
+            logStatistics();
+        if (time_sync_send_timer.isExpired())
+        {
+            sp::io::DataBuffer timeSync;
+            timeSync << CMD_TIME_SYNC << NetworkTiming::now();
+            mainSocket->send(timeSync);
+        }
         if (!mainSocket->isConnected() || no_data_timeout.isExpired())
         {
             LOG(INFO) << "Disconnected proxy";
@@ -152,15 +229,18 @@ void GameServerProxy::update(float delta)
             engine->shutdown();
         }
     }
+    //Queues of the clients also hold data that does not depend on the server connection, like the world from the cache.
+    flushClients();
 
     if (proxyName != "")
     {
         handleBroadcastUDPSocket(delta);
     }
 
-    if (listenSocket.accept(*newSocket))
+    for(int accepted=0; accepted<multiplayerMaxAcceptsPerUpdate && listenSocket.accept(*newSocket); accepted++)
     {
         ClientInfo info;
+        info.clientId = nextTempId++;
         info.socket = std::move(newSocket);
         newSocket = std::make_unique<sp::io::network::TcpSocket>();
         newSocket->setBlocking(false);
@@ -172,12 +252,13 @@ void GameServerProxy::update(float delta)
         clientList.emplace_back(std::move(info));
     }
 
+    receiveFromClients();
     for(unsigned int n=0; n<clientList.size(); n++)
     {
-        sp::io::DataBuffer packet;
         auto& info = clientList[n];
-        while(info.socket && info.socket->receive(packet))
+        for(size_t index=0; index<info.receivedCount && info.socket; index++)
         {
+            sp::io::DataBuffer& packet = info.receivedPackets[index];
             command_t command;
             packet >> command;
             switch(info.receiveState)
@@ -202,10 +283,22 @@ void GameServerProxy::update(float delta)
                         int32_t clientVersion;
                         string clientPassword;
                         packet >> clientVersion >> clientPassword;
+                        //A chained proxy adds the (empty) session fields of a GameClient and its proxy mark.
+                        if (packet.available())
+                        {
+                            int32_t resumeClientId;
+                            uint32_t resumeTokenHigh, resumeTokenLow, resumeTick;
+                            packet >> resumeClientId >> resumeTokenHigh >> resumeTokenLow >> resumeTick;
+                        }
+                        if (packet.available())
+                            packet >> info.isProxy;
                         if (mainSocket && clientVersion == serverVersion && clientPassword == password)
                         {
+                            //With a working world cache the new client gets the world from this proxy, the server only assigns the id.
+                            // A chained proxy is passed on as relay, so the server does not report it to the game.
+                            info.worldFromCache = worldCache.isValid();
                             sp::io::DataBuffer serverUpdate;
-                            serverUpdate << CMD_NEW_PROXY_CLIENT << info.clientId;
+                            serverUpdate << CMD_NEW_PROXY_CLIENT << info.clientId << info.worldFromCache << info.isProxy;
                             mainSocket->send(serverUpdate);
                         }
                         else
@@ -226,8 +319,42 @@ void GameServerProxy::update(float delta)
                 switch(command)
                 {
                 case CMD_CLIENT_COMMAND:
-                    packet >> info.commandObjectId;
-                    info.receiveState = CRS_Command;
+                    forwardClientCommands(info.clientId, packet);
+                    break;
+                case CMD_NEW_PROXY_CLIENT:
+                    {
+                        //A chained proxy got a new client. Ask the server for an id, with a temporary id that is unique for this proxy.
+                        int32_t proxiedTempId = 0;
+                        bool worldCached = false;
+                        bool relay = false;
+                        packet >> proxiedTempId;
+                        if (packet.available())
+                            packet >> worldCached;
+                        if (packet.available())
+                            packet >> relay;
+                        info.isProxy = true;
+                        int32_t tempId = nextTempId++;
+                        pendingProxiedClients[tempId] = {info.clientId, proxiedTempId};
+                        sp::io::DataBuffer serverUpdate;
+                        serverUpdate << CMD_NEW_PROXY_CLIENT << tempId << worldCached << relay;
+                        mainSocket->send(serverUpdate);
+                    }
+                    break;
+                case CMD_DEL_PROXY_CLIENT:
+                    {
+                        int32_t proxiedId = 0;
+                        packet >> proxiedId;
+                        if (info.proxiedIds.erase(proxiedId))
+                            mainSocket->send(packet);
+                    }
+                    break;
+                case CMD_PROXY_CLIENT_COMMAND:
+                    {
+                        int32_t proxiedId = 0;
+                        packet >> proxiedId;
+                        if (info.proxiedIds.find(proxiedId) != info.proxiedIds.end())
+                            forwardClientCommands(proxiedId, packet);
+                    }
                     break;
                 case CMD_AUDIO_COMM_START:
                 case CMD_AUDIO_COMM_DATA:
@@ -235,26 +362,27 @@ void GameServerProxy::update(float delta)
                     {
                         int32_t client_id = 0;
                         packet >> client_id;
-                        if (client_id == info.clientId)
+                        if (client_id == info.clientId || info.proxiedIds.find(client_id) != info.proxiedIds.end())
                             mainSocket->send(packet);
                     }
                     break;
                 case CMD_ALIVE_RESP:
                     break;
+                case CMD_TIME_SYNC:
+                    {
+                        //Answer with our estimate of the server time, so the client syncs to the server clock and not ours.
+                        double clientTime = 0.0;
+                        packet >> clientTime;
+                        sp::io::DataBuffer reply;
+                        reply << CMD_TIME_SYNC_RESP << clientTime << (NetworkTiming::now() + server_timing.getClockOffset());
+                        info.socket->send(reply);
+                    }
+                    break;
                 default:
                     LOG(ERROR) << "Unknown command from client: " << command;
                     break;
                 }
                 break;
-            case CRS_Command:
-                {
-                    sp::io::DataBuffer mainPacket;
-                    mainPacket << CMD_PROXY_CLIENT_COMMAND << info.commandObjectId << info.clientId;
-                    mainSocket->send(mainPacket);
-                    mainSocket->send(packet);
-                }
-                info.receiveState = CRS_Main;
-                break;
             }
         }
         if (info.socket == NULL || !info.socket->isConnected())
@@ -264,6 +392,13 @@ void GameServerProxy::update(float delta)
                 sp::io::DataBuffer serverUpdate;
                 serverUpdate << CMD_DEL_PROXY_CLIENT << info.clientId;
                 mainSocket->send(serverUpdate);
+                //Everything behind a chained proxy is gone with it.
+                for(auto proxiedId : info.proxiedIds)
+                {
+                    sp::io::DataBuffer proxiedUpdate;
+                    proxiedUpdate << CMD_DEL_PROXY_CLIENT << proxiedId;
+                    mainSocket->send(proxiedUpdate);
+                }
             }
             clientList.erase(clientList.begin() + n);
             n--;
@@ -271,25 +406,152 @@ void GameServerProxy::update(float delta)
     }
 }
 
-void GameServerProxy::sendAll(sp::io::DataBuffer& packet)
+void GameServerProxy::setSendQueueLimits(size_t high_water_mark, size_t hard_limit)
+{
+    sendQueueHighWaterMark = high_water_mark;
+    sendQueueHardLimit = hard_limit;
+}
+
+void GameServerProxy::sendAll(sp::io::DataBuffer& packet, bool droppable)
 {
-    if (targetClients.empty())
+    sp::io::network::TcpSocket::SharedFrame frame;
+    sp::io::DataBuffer targetPacket;
+    for(auto& info : clientList)
     {
-        for(auto& info : clientList)
+        if (!info.validClient || !info.socket)
+            continue;
+        targetPacket.clear();
+        if (!targetClients.empty())
         {
-            if (info.validClient && info.socket)
-                info.socket->send(packet);
+            if (info.isProxy)
+            {
+                //Pass the targeting on to a chained proxy, limited to the clients behind it.
+                targetPacket << CMD_PROXY_TO_CLIENTS;
+                bool targeted = false;
+                for(auto id : targetClients)
+                {
+                    if (info.proxiedIds.find(id) != info.proxiedIds.end())
+                    {
+                        targetPacket << id;
+                        targeted = true;
+                    }
+                }
+                if (!targeted)
+                    continue;
+            }
+            else if (targetClients.find(info.clientId) == targetClients.end())
+            {
+                continue;
+            }
         }
+        if (droppable && info.socket->getSendQueueSize() > sendQueueHighWaterMark)
+        {
+            info.droppedPackets++;
+            statistics.frames_dropped++;
+            continue;
+        }
+        if (targetPacket.getDataSize() > 0)
+            info.socket->queue(targetPacket);
+        if (!frame)
+            frame = sp::io::network::TcpSocket::makeSharedFrame(packet);
+        info.socket->queue(frame);
+        statistics.frames_forwarded++;
+        statistics.bytes_forwarded += frame->size();
     }
-    else
+    targetClients.clear();
+}
+
+void GameServerProxy::setIoThreadCount(int count)
+{
+    ioWorkers.setThreadCount(std::max(count, 0));
+}
+
+void GameServerProxy::flushClients()
+{
+    //Everything received from the server is only queued, send it out with one call per client.
+    // Each client is only touched by one worker, and the shared frames are reference counted thread safe.
+    ioWorkers.run(clientList.size(), [this](size_t n)
+    {
+        if (clientList[n].socket)
+            clientList[n].socket->sendSendQueue();
+    });
+    for(auto& info : clientList)
+    {
+        if (!info.socket)
+            continue;
+        if (info.socket->getSendQueueSize() > sendQueueHardLimit)
+        {
+            LOG(WARNING) << "Proxy client " << info.clientId << " send queue exceeded " << sendQueueHardLimit << " bytes, disconnecting (" << info.droppedPackets << " packets dropped)";
+            info.socket->close();
+        }
+    }
+}
+
+void GameServerProxy::receiveFromClients()
+{
+    //Only the reading happens on the workers, the packets are handled afterwards on the main thread in client order.
+    ioWorkers.run(clientList.size(), [this](size_t n)
     {
-        for(auto& info : clientList)
+        auto& info = clientList[n];
+        info.receivedCount = 0;
+        while(info.socket)
         {
-            if (info.validClient && info.socket && targetClients.find(info.clientId) != targetClients.end())
-                info.socket->send(packet);
+            if (info.receivedCount == info.receivedPackets.size())
+                info.receivedPackets.emplace_back();
+            if (!info.socket->receive(info.receivedPackets[info.receivedCount]))
+                break;
+            info.receivedCount++;
+            //During authentication a packet can hand the socket over to the upstream connection, so read no further than one.
+            if (info.receiveState == CRS_Auth)
+                break;
         }
-        targetClients.clear();
+    });
+}
+
+void GameServerProxy::forwardClientCommands(int32_t commandClientId, sp::io::DataBuffer& packet)
+{
+    //Re-encode the batch instead of forwarding it blindly, so a malformed client cannot corrupt the stream of other clients.
+    sp::io::DataBuffer mainPacket;
+    mainPacket << CMD_PROXY_CLIENT_COMMAND << commandClientId;
+    while(packet.available())
+    {
+        int32_t objectId = 0;
+        uint32_t sequence = 0;
+        uint32_t size = 0;
+        sp::io::DataView data;
+        packet >> objectId >> sequence >> size;
+        if (!packet.readView(data, size))
+            break;
+        mainPacket << objectId << sequence << size;
+        mainPacket.appendRaw(data.getData(), data.getDataSize());
     }
+    mainSocket->send(mainPacket);
+}
+
+GameServerProxy::Statistics GameServerProxy::getStatistics() const
+{
+    Statistics result = statistics;
+    for(auto& info : clientList)
+    {
+        if (!info.validClient)
+            continue;
+        result.clients++;
+        if (info.isProxy)
+        {
+            result.proxies++;
+            result.proxied_clients += info.proxiedIds.size();
+        }
+    }
+    return result;
+}
+
+void GameServerProxy::logStatistics()
+{
+    Statistics stats = getStatistics();
+    if (stats.clients == 0)
+        return;
+    LOG(INFO) << "Proxy fan-out: " << stats.clients << " connections (" << stats.proxies << " proxies with " << stats.proxied_clients << " clients), "
+        << stats.frames_received << " frames received, " << stats.frames_forwarded << " forwarded (" << stats.bytes_forwarded << " bytes), " << stats.frames_dropped << " dropped";
 }
 
 void GameServerProxy::handleBroadcastUDPSocket(float delta)
@@ -3,10 +3,16 @@
 
 #include <memory>
 #include "multiplayer_server.h"
+#include "multiplayer_world_cache.h"
+#include "multiplayer_worker_pool.h"
 
+//Relays a server to its own clients. Everything the server sends to the proxy connection goes to all clients of the proxy,
+// object visibility of the server is per connection and is not filtered again here.
 class GameServerProxy : public Updatable
 {
     sp::SystemTimer no_data_timeout;
+    sp::SystemTimer time_sync_send_timer;
+    NetworkTiming server_timing;
     constexpr static float noDataDisconnectTime = 20.0f;
 
     sp::io::network::UdpSocket broadcast_listen_socket;
@@ -16,19 +22,35 @@ class GameServerProxy : public Updatable
     enum EClientReceiveState
     {
         CRS_Auth,
-        CRS_Main,
-        CRS_Command
+        CRS_Main
     };
     struct ClientInfo
     {
         std::unique_ptr<sp::io::network::TcpSocket> socket;
         int32_t clientId = 0;
-        int32_t commandObjectId = 0;
         bool validClient = false;
         EClientReceiveState receiveState = CRS_Auth;
+        uint32_t droppedPackets = 0;
+        bool worldFromCache = false; //The server was asked not to send the world for this client, it comes from worldCache
+        bool isProxy = false; //Another proxy, chained behind this one
+        std::unordered_set<int32_t> proxiedIds; //Clients behind a chained proxy
+        std::vector<sp::io::DataBuffer> receivedPackets; //Filled by receiveFromClients, only the first receivedCount are valid
+        size_t receivedCount = 0;
+    };
+    //Client of a chained proxy that is waiting for an id from the server.
+    struct PendingProxiedClient
+    {
+        int32_t proxyClientId;  //Id of the chained proxy connection
+        int32_t tempId;         //Temporary id used between the chained proxy and this proxy
     };
     std::vector<ClientInfo> clientList;
     std::unordered_set<int32_t> targetClients;
+    std::unordered_map<int32_t, PendingProxiedClient> pendingProxiedClients; //On the temporary id send to the server
+    int32_t nextTempId = 1;
+    size_t sendQueueHighWaterMark = defaultSendQueueHighWaterMark;
+    size_t sendQueueHardLimit = defaultSendQueueHardLimit;
+    ReplicationWorldCache worldCache;
+    ReplicationWorkerPool ioWorkers;
 
     int32_t clientId = 0;
     string password;
@@ -36,7 +58,10 @@ class GameServerProxy : public Updatable
     string proxyName;
     float boardcastServerDelay;
     std::unique_ptr<sp::io::network::TcpSocket> mainSocket;
+    sp::SystemTimer statisticsLogTimer;
+    constexpr static float statisticsLogInterval = 60.0f;
 public:
+    //Proxies can be chained, by giving another proxy as hostname. Each proxy then forwards to its own clients and the proxies behind it.
     GameServerProxy(sp::io::network::Address hostname, int hostPort = defaultServerPort, string password = "", int listenPort = defaultServerPort, string proxyName="");
     GameServerProxy(string password = "", int listenPort = defaultServerPort, string proxyName="");
     virtual ~GameServerProxy();
@@ -44,8 +69,35 @@ public:
     virtual void destroy() override;
 
     virtual void update(float delta) override;
+
+    //Limits on the amount of queued data per downstream client. Above the high water mark audio data is dropped for that client,
+    // above the hard limit the client is disconnected, so a single slow client cannot hold up the proxy or grow its memory use.
+    void setSendQueueLimits(size_t high_water_mark, size_t hard_limit);
+
+    //Spread the socket work for the clients (sending queued data and receiving) over this many extra threads. 0 (the default) does it all on the main thread.
+    void setIoThreadCount(int count);
+
+    //Fan-out of this proxy alone, each proxy in a chain reports its own.
+    struct Statistics
+    {
+        size_t clients = 0;             //Authenticated connections, including chained proxies
+        size_t proxies = 0;             //Chained proxies
+        size_t proxied_clients = 0;     //Clients behind the chained proxies
+        uint64_t frames_received = 0;   //From the server, or the upstream proxy
+        uint64_t frames_forwarded = 0;  //Queued to connections, a frame forwarded to 10 connections counts 10 times
+        uint64_t bytes_forwarded = 0;
+        uint64_t frames_dropped = 0;
+    };
+    Statistics getStatistics() const;
 private:
-    void sendAll(sp::io::DataBuffer& packet);
+    Statistics statistics;
+
+    //Forward a packet from the server to the downstream clients. The frame is encoded once and shared by all client send queues.
+    void sendAll(sp::io::DataBuffer& packet, bool droppable = false);
+    void flushClients();
+    void receiveFromClients();
+    void forwardClientCommands(int32_t commandClientId, sp::io::DataBuffer& packet);
+    void logStatistics();
 
     void handleBroadcastUDPSocket(float delta);
 };
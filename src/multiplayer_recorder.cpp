@@ -0,0 +1,330 @@
+#include "multiplayer_recorder.h"
+#include "logging.h"
+
+#include <string.h>
+
+using namespace replication_record;
+
+static constexpr char file_magic[4] = {'S', 'P', 'R', 'R'};
+static constexpr char index_magic[4] = {'S', 'P', 'R', 'I'};
+static constexpr size_t record_header_size = sizeof(uint8_t) + sizeof(double) + sizeof(uint32_t);
+static constexpr size_t index_trailer_size = sizeof(uint64_t) * 2 + sizeof(index_magic);
+
+static uint64_t fileTell(FILE* f)
+{
+#ifdef _WIN32
+    return _ftelli64(f);
+#else
+    return ftello(f);
+#endif
+}
+
+static bool fileSeek(FILE* f, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(f, offset, SEEK_SET) == 0;
+#else
+    return fseeko(f, offset, SEEK_SET) == 0;
+#endif
+}
+
+ReplicationRecorder::ReplicationRecorder()
+: f(nullptr)
+{
+}
+
+ReplicationRecorder::~ReplicationRecorder()
+{
+    close();
+}
+
+bool ReplicationRecorder::open(const string& filename)
+{
+    close();
+    f = fopen(filename.c_str(), "wb");
+    if (!f)
+    {
+        LOG(ERROR) << "Failed to open replication recording: " << filename;
+        return false;
+    }
+    fwrite(file_magic, sizeof(file_magic), 1, f);
+    fwrite(&file_version, sizeof(file_version), 1, f);
+    keyframes.clear();
+    ticks.clear();
+    return true;
+}
+
+void ReplicationRecorder::close()
+{
+    if (!f)
+        return;
+    for(auto& entry : keyframes)
+    {
+        fwrite(&entry.time, sizeof(entry.time), 1, f);
+        fwrite(&entry.offset, sizeof(entry.offset), 1, f);
+    }
+    for(auto& entry : ticks)
+    {
+        fwrite(&entry.time, sizeof(entry.time), 1, f);
+        fwrite(&entry.offset, sizeof(entry.offset), 1, f);
+    }
+    uint64_t keyframe_count = keyframes.size();
+    uint64_t tick_count = ticks.size();
+    fwrite(&keyframe_count, sizeof(keyframe_count), 1, f);
+    fwrite(&tick_count, sizeof(tick_count), 1, f);
+    fwrite(index_magic, sizeof(index_magic), 1, f);
+    fclose(f);
+    f = nullptr;
+}
+
+void ReplicationRecorder::writeFrame(double time, const sp::io::DataBuffer& packet)
+{
+    writeRecord(Type::Frame, time, packet.getData(), packet.getDataSize());
+}
+
+void ReplicationRecorder::beginKeyframe(double time)
+{
+    if (f)
+        keyframes.push_back({time, fileTell(f)});
+    writeRecord(Type::KeyframeStart, time, nullptr, 0);
+}
+
+void ReplicationRecorder::endKeyframe(double time)
+{
+    writeRecord(Type::KeyframeEnd, time, nullptr, 0);
+}
+
+void ReplicationRecorder::writeTick(double time)
+{
+    if (f)
+        ticks.push_back({time, fileTell(f)});
+    writeRecord(Type::Tick, time, nullptr, 0);
+}
+
+void ReplicationRecorder::writeRecord(Type type, double time, const void* data, uint32_t size)
+{
+    if (!f)
+        return;
+    uint8_t type_value = uint8_t(type);
+    fwrite(&type_value, sizeof(type_value), 1, f);
+    fwrite(&time, sizeof(time), 1, f);
+    fwrite(&size, sizeof(size), 1, f);
+    if (size > 0)
+        fwrite(data, size, 1, f);
+}
+
+ReplicationPlayback::ReplicationPlayback()
+: f(nullptr), data_start(0), data_end(0), speed(1.0f), time(0.0), finished(true), reset(false)
+, need_keyframe(true), in_keyframe(false), applying_keyframe(false), has_pending(false)
+{
+}
+
+ReplicationPlayback::~ReplicationPlayback()
+{
+    if (f)
+        fclose(f);
+}
+
+bool ReplicationPlayback::open(const string& filename)
+{
+    if (f)
+        fclose(f);
+    f = fopen(filename.c_str(), "rb");
+    if (!f)
+    {
+        LOG(ERROR) << "Failed to open replication recording: " << filename;
+        return false;
+    }
+    char magic[sizeof(file_magic)];
+    uint32_t version = 0;
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, file_magic, sizeof(magic)) != 0 || fread(&version, sizeof(version), 1, f) != 1 || version != file_version)
+    {
+        LOG(ERROR) << "Not a supported replication recording: " << filename;
+        fclose(f);
+        f = nullptr;
+        return false;
+    }
+    data_start = fileTell(f);
+    if (!readIndex())
+        buildIndex();
+
+    seek(getStartTime());
+    reset = false;
+    wall_clock.restart();
+    return true;
+}
+
+void ReplicationPlayback::seek(double target)
+{
+    if (!f)
+        return;
+    //Start from the last keyframe before the target, or the first keyframe if the target is before the recording.
+    uint64_t offset = data_start;
+    double start_time = target;
+    for(auto& entry : keyframes)
+    {
+        if (entry.time > target && offset != data_start)
+            break;
+        offset = entry.offset;
+        start_time = std::max(entry.time, target);
+    }
+    fileSeek(f, offset);
+    time = start_time;
+    has_pending = false;
+    in_keyframe = false;
+    applying_keyframe = false;
+    need_keyframe = true;
+    reset = true;
+    finished = false;
+}
+
+void ReplicationPlayback::seekToTick(size_t index)
+{
+    if (index < ticks.size())
+        seek(ticks[index].time);
+}
+
+double ReplicationPlayback::getStartTime() const
+{
+    if (!keyframes.empty())
+        return keyframes.front().time;
+    if (!ticks.empty())
+        return ticks.front().time;
+    return 0.0;
+}
+
+double ReplicationPlayback::getEndTime() const
+{
+    if (!ticks.empty())
+        return ticks.back().time;
+    return getStartTime();
+}
+
+void ReplicationPlayback::update()
+{
+    float elapsed = wall_clock.restart();
+    if (!finished)
+        time += elapsed * speed;
+}
+
+bool ReplicationPlayback::receive(sp::io::DataBuffer& packet)
+{
+    if (!f)
+        return false;
+    while(true)
+    {
+        if (!has_pending)
+        {
+            if (!readRecord(pending))
+            {
+                finished = true;
+                return false;
+            }
+            has_pending = true;
+        }
+        if (!applying_keyframe && pending.time > time)
+            return false;
+        has_pending = false;
+        switch(pending.type)
+        {
+        case Type::KeyframeStart:
+            //Keyframes are only applied to start from, during normal playback the frames before it already hold the same state.
+            in_keyframe = true;
+            applying_keyframe = need_keyframe;
+            need_keyframe = false;
+            break;
+        case Type::KeyframeEnd:
+            in_keyframe = false;
+            applying_keyframe = false;
+            break;
+        case Type::Tick:
+            break;
+        case Type::Frame:
+            if (in_keyframe && !applying_keyframe)
+                break;
+            packet = std::move(pending.data);
+            return true;
+        }
+    }
+}
+
+bool ReplicationPlayback::takeReset()
+{
+    bool result = reset;
+    reset = false;
+    return result;
+}
+
+bool ReplicationPlayback::readRecord(Record& record)
+{
+    if (fileTell(f) + record_header_size > data_end)
+        return false;
+    uint8_t type = 0;
+    uint32_t size = 0;
+    if (fread(&type, sizeof(type), 1, f) != 1 || fread(&record.time, sizeof(record.time), 1, f) != 1 || fread(&size, sizeof(size), 1, f) != 1)
+        return false;
+    if (fileTell(f) + size > data_end)
+        return false;
+    record.type = Type(type);
+    record.data.resize(size);
+    if (size > 0 && fread(record.data.data(), size, 1, f) != 1)
+        return false;
+    return true;
+}
+
+bool ReplicationPlayback::readIndex()
+{
+    if (fseek(f, 0, SEEK_END) != 0)
+        return false;
+    uint64_t file_size = fileTell(f);
+    if (file_size < data_start + index_trailer_size)
+        return false;
+    uint64_t keyframe_count = 0;
+    uint64_t tick_count = 0;
+    char magic[sizeof(index_magic)];
+    fileSeek(f, file_size - index_trailer_size);
+    if (fread(&keyframe_count, sizeof(keyframe_count), 1, f) != 1 || fread(&tick_count, sizeof(tick_count), 1, f) != 1 || fread(magic, sizeof(magic), 1, f) != 1)
+        return false;
+    if (memcmp(magic, index_magic, sizeof(magic)) != 0)
+        return false;
+    uint64_t index_size = (keyframe_count + tick_count) * (sizeof(double) + sizeof(uint64_t));
+    if (file_size < data_start + index_trailer_size + index_size)
+        return false;
+    data_end = file_size - index_trailer_size - index_size;
+    fileSeek(f, data_end);
+    keyframes.resize(keyframe_count);
+    ticks.resize(tick_count);
+    for(auto& entry : keyframes)
+    {
+        if (fread(&entry.time, sizeof(entry.time), 1, f) != 1 || fread(&entry.offset, sizeof(entry.offset), 1, f) != 1)
+            return false;
+    }
+    for(auto& entry : ticks)
+    {
+        if (fread(&entry.time, sizeof(entry.time), 1, f) != 1 || fread(&entry.offset, sizeof(entry.offset), 1, f) != 1)
+            return false;
+    }
+    return true;
+}
+
+void ReplicationPlayback::buildIndex()
+{
+    //No index, the recording was not closed properly. Scan it and use everything up to the last complete record.
+    LOG(WARNING) << "Replication recording has no index, scanning it";
+    keyframes.clear();
+    ticks.clear();
+    fseek(f, 0, SEEK_END);
+    data_end = fileTell(f);
+    fileSeek(f, data_start);
+    uint64_t offset = data_start;
+    Record record;
+    while(readRecord(record))
+    {
+        if (record.type == Type::KeyframeStart)
+            keyframes.push_back({record.time, offset});
+        else if (record.type == Type::Tick)
+            ticks.push_back({record.time, offset});
+        offset = fileTell(f);
+    }
+    data_end = offset;
+}
@@ -0,0 +1,112 @@
+#ifndef MULTIPLAYER_RECORDER_H
+#define MULTIPLAYER_RECORDER_H
+
+#include "io/dataBuffer.h"
+#include "stringImproved.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+//File format shared by the recorder and the playback:
+// "SPRR", version, followed by records of [type:uint8][server time:double][size:uint32][data].
+// Keyframes are the frames between a KeyframeStart and KeyframeEnd record, and hold the create packets of the full world.
+// On close, an index of all keyframes and ticks is appended, followed by the entry counts and "SPRI".
+namespace replication_record
+{
+    static constexpr uint32_t file_version = 1;
+
+    enum class Type : uint8_t
+    {
+        Frame = 0,
+        KeyframeStart = 1,
+        KeyframeEnd = 2,
+        Tick = 3,
+    };
+
+    struct IndexEntry
+    {
+        double time;
+        uint64_t offset;
+    };
+}
+
+//Writes the replication stream of a GameServer to a file.
+class ReplicationRecorder
+{
+public:
+    ReplicationRecorder();
+    ~ReplicationRecorder();
+
+    bool open(const string& filename);
+    void close();
+    bool isOpen() const { return f != nullptr; }
+
+    void writeFrame(double time, const sp::io::DataBuffer& packet);
+    void beginKeyframe(double time);
+    void endKeyframe(double time);
+    void writeTick(double time);
+private:
+    void writeRecord(replication_record::Type type, double time, const void* data, uint32_t size);
+
+    FILE* f;
+    std::vector<replication_record::IndexEntry> keyframes;
+    std::vector<replication_record::IndexEntry> ticks;
+};
+
+//Reads back a recorded replication stream, for GameClient playback.
+class ReplicationPlayback
+{
+public:
+    ReplicationPlayback();
+    ~ReplicationPlayback();
+
+    bool open(const string& filename);
+
+    void setSpeed(float speed) { this->speed = speed; } //1.0 is real time, higher values fast-forward
+    float getSpeed() const { return speed; }
+    void seek(double time);
+    void seekToTick(size_t index);
+
+    double getTime() const { return time; }
+    double getStartTime() const;
+    double getEndTime() const;
+    size_t getTickCount() const { return ticks.size(); }
+    bool isFinished() const { return finished; }
+
+    //Used by GameClient to consume the stream.
+    void update(); //Advance the playback time with the wall time passed since the last call.
+    bool receive(sp::io::DataBuffer& packet); //Next frame that is due at the current playback time.
+    bool takeReset(); //True once after a seek, the consumer needs to drop all its objects before receiving the keyframe.
+private:
+    struct Record
+    {
+        replication_record::Type type;
+        double time;
+        std::vector<uint8_t> data;
+    };
+
+    bool readRecord(Record& record);
+    bool readIndex();
+    void buildIndex();
+
+    FILE* f;
+    uint64_t data_start;
+    uint64_t data_end;
+    std::vector<replication_record::IndexEntry> keyframes;
+    std::vector<replication_record::IndexEntry> ticks;
+
+    sp::SystemStopwatch wall_clock;
+    float speed;
+    double time;
+    bool finished;
+    bool reset;
+    bool need_keyframe;
+    bool in_keyframe;
+    bool applying_keyframe;
+    bool has_pending;
+    Record pending;
+};
+
+#endif//MULTIPLAYER_RECORDER_H
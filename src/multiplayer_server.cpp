@@ -2,21 +2,22 @@
 #include "multiplayer_client.h"
 #include "multiplayer_internal.h"
 #include "engine.h"
+#include "scriptInterface.h"
+#include "collisionable.h"
 
 #include "io/http/request.h"
+#include "io/mappedFile.h"
 
-#define MULTIPLAYER_COLLECT_DATA_STATS 0
-
-#if MULTIPLAYER_COLLECT_DATA_STATS
-sp::SystemTimer multiplayer_stats_dump;
-static std::unordered_map<string, int> multiplayer_stats;
-#define ADD_MULTIPLAYER_STATS(name, bytes) multiplayer_stats[name] += (bytes)
-#else
-#define ADD_MULTIPLAYER_STATS(name, bytes) do {} while(0)
-#endif
+#include <glm/geometric.hpp>
+#include <random>
+#include <stdio.h>
+#include <string.h>
 
 P<GameServer> game_server;
 
+static constexpr char world_save_magic[4] = {'S', 'P', 'W', 'S'};
+static constexpr uint32_t world_save_version = 1;
+
 GameServer::GameServer(string server_name, int version_number, int listen_port)
 : server_name(server_name), listen_port(listen_port), version_number(version_number)
 {
@@ -27,7 +28,16 @@ GameServer::GameServer(string server_name, int version_number, int listen_port)
     sendDataRate = 0.0;
     sendDataRatePerClient = 0.0;
     boardcastServerDelay = 0.0;
+    send_queue_high_water_mark = defaultSendQueueHighWaterMark;
+    send_queue_hard_limit = defaultSendQueueHardLimit;
+    session_resume_time = 0.0f;
+    replication_tick = 0;
+    deleted_objects_start_tick = 0;
+    replication_lod_active = false;
+    replication_lod_time = 0.0;
     keep_alive_send_timer.repeat(10);;
+    time_sync_send_timer.repeat(multiplayerTimeSyncInterval);
+    start_time = NetworkTiming::now();
 
     nextObjectId = 1;
     nextclient_id = 1;
@@ -48,9 +58,6 @@ GameServer::GameServer(string server_name, int version_number, int listen_port)
         LOG(Error, "Failed to join multicast group for local server discovery");
     }
     broadcast_listen_socket.setBlocking(false);
-#if MULTIPLAYER_COLLECT_DATA_STATS
-    multiplayer_stats_dump.repeat(1.0f);
-#endif
 }
 
 GameServer::~GameServer()
@@ -58,6 +65,8 @@ GameServer::~GameServer()
     destroy();
     if (master_server_update_thread.joinable())
         master_server_update_thread.join();
+    if (world_save_thread.joinable())
+        world_save_thread.join();
 }
 
 void GameServer::connectToProxy(sp::io::network::Address address, int port)
@@ -74,9 +83,7 @@ void GameServer::connectToProxy(sp::io::network::Address address, int port)
     info.socket = std::move(socket);
     info.socket->setBlocking(false);
     info.socket->setDelay(false);
-    info.client_id = nextclient_id;
-    info.receive_state = CRS_Auth;
-    nextclient_id++;
+    initClientInfo(info);
     {
         sp::io::DataBuffer packet;
         packet << CMD_SERVER_CONNECT_TO_PROXY;
@@ -93,6 +100,7 @@ void GameServer::connectToProxy(sp::io::network::Address address, int port)
 
 void GameServer::destroy()
 {
+    stopRecording();
     clientList.clear();
     objectMap.clear();
 
@@ -109,6 +117,32 @@ P<MultiplayerObject> GameServer::getObjectById(int32_t id)
     return NULL;
 }
 
+bool GameServer::buildUpdatePacket(MultiplayerObject* obj, float delta, sp::io::DataBuffer& packet, std::vector<MemberUpdateRange>& member_ranges)
+{
+    packet.clear();
+    packet << CMD_UPDATE_VALUE;
+    packet << int32_t(obj->multiplayerObjectId);
+    member_ranges.clear();
+    for(unsigned int n=0; n<obj->memberReplicationInfo.size(); n++)
+    {
+        if (obj->memberReplicationInfo[n].update_timeout > 0.0 && !obj->replicate_all_members)
+        {
+            obj->memberReplicationInfo[n].update_timeout -= delta;
+        }else{
+            if ((obj->memberReplicationInfo[n].isChangedFunction)(obj->memberReplicationInfo[n].ptr, &obj->memberReplicationInfo[n].prev_data) || obj->replicate_all_members)
+            {
+                unsigned int member_start = packet.getDataSize();
+                writeMember(obj, n, packet);
+                member_ranges.push_back({uint16_t(n), member_start, unsigned(packet.getDataSize())});
+
+                obj->memberReplicationInfo[n].update_timeout = obj->memberReplicationInfo[n].update_delay;
+            }
+        }
+    }
+    obj->replicate_all_members = false;
+    return !member_ranges.empty();
+}
+
 void GameServer::update(float /*gameDelta*/)
 {
     sp::SystemStopwatch update_run_time_clock;    //Clock used to measure how much time this update cycle is costing us.
@@ -118,6 +152,11 @@ void GameServer::update(float /*gameDelta*/)
 
     sendDataCounter = 0;
     sendDataCounterPerClient = 0;
+    replication_tick++;
+    updateLodFocus();
+
+    if (!world_save_busy)
+        finishWorldSave();
 
     if (lastGameSpeed != engine->getGameSpeed())
     {
@@ -128,6 +167,8 @@ void GameServer::update(float /*gameDelta*/)
     }
 
     std::vector<int32_t> delList;
+    replication_objects.clear();
+    visibility_changed_objects.clear();
     for(std::unordered_map<int32_t, P<MultiplayerObject> >::iterator i=objectMap.begin(); i != objectMap.end(); i++)
     {
         int id = i->first;
@@ -137,72 +178,125 @@ void GameServer::update(float /*gameDelta*/)
             if (!obj->replicated)
             {
                 obj->replicated = true;
+                obj->create_tick = replication_tick;
+                obj->replication_visibility_changed = false;
 
                 sp::io::DataBuffer packet;
                 generateCreatePacketFor(obj, packet);
                 //Call the isChanged function for each replication info, so the prev_data is updated.
+                // The create packet counts as a send, so members with an update delay wait for that delay before their first update.
                 for(unsigned int n=0; n<obj->memberReplicationInfo.size(); n++)
-                    obj->memberReplicationInfo[n].isChangedFunction(obj->memberReplicationInfo[n].ptr, &obj->memberReplicationInfo[n].prev_data);
-                sendAll(packet);
-                ADD_MULTIPLAYER_STATS(obj->multiplayerClassIdentifier + "::CREATE", packet.getDataSize());
-            }
-            sp::io::DataBuffer packet;
-            packet << CMD_UPDATE_VALUE;
-            packet << int32_t(obj->multiplayerObjectId);
-#if MULTIPLAYER_COLLECT_DATA_STATS
-            int overhead = packet.getDataSize();
-#endif
-            int cnt = 0;
-            for(unsigned int n=0; n<obj->memberReplicationInfo.size(); n++)
-            {
-                if (obj->memberReplicationInfo[n].update_timeout > 0.0)
                 {
-                    obj->memberReplicationInfo[n].update_timeout -= delta;
-                }else{
-                    if ((obj->memberReplicationInfo[n].isChangedFunction)(obj->memberReplicationInfo[n].ptr, &obj->memberReplicationInfo[n].prev_data))
-                    {
-#if MULTIPLAYER_COLLECT_DATA_STATS
-                        int packet_size = packet.getDataSize();
-#endif
-                        packet << int16_t(n);
-                        (obj->memberReplicationInfo[n].sendFunction)(obj->memberReplicationInfo[n].ptr, packet);
-                        cnt++;
-                        ADD_MULTIPLAYER_STATS(obj->multiplayerClassIdentifier + "::" + obj->memberReplicationInfo[n].name, packet.getDataSize() - packet_size);
-
-                        obj->memberReplicationInfo[n].update_timeout = obj->memberReplicationInfo[n].update_delay;
-                    }
+                    obj->memberReplicationInfo[n].isChangedFunction(obj->memberReplicationInfo[n].ptr, &obj->memberReplicationInfo[n].prev_data);
+                    obj->memberReplicationInfo[n].update_timeout = obj->memberReplicationInfo[n].update_delay;
                 }
+                //Clients that cannot see the object do not get it created.
+                if (isVisibilityRestricted(*obj))
+                    for(auto& client : clientList)
+                        if (client.receive_state != CRS_Auth && !isObjectVisibleTo(client, *obj))
+                            client.hidden_objects[id] = replication_tick;
+                sendObjectPacket(id, packet);
+                replication_profiler.addCreate(obj->profiler_class_index, packet.getDataSize());
             }
-            if (cnt > 0)
+            else if (obj->replication_visibility_changed)
             {
-                sendAll(packet);
-                ADD_MULTIPLAYER_STATS(obj->multiplayerClassIdentifier + "::OVERHEAD", overhead);
+                obj->replication_visibility_changed = false;
+                visibility_changed_objects.push_back(*obj);
             }
+            //Objects nobody can see are not serialized at all, they are created in full on a client that gets to see them.
+            if (!recorder && isVisibilityRestricted(*obj) && !isObjectVisibleToAnyClient(*obj))
+                continue;
+            replication_objects.push_back(*obj);
         }else{
             delList.push_back(id);
         }
     }
+
+    //Build the update packets of the objects that allow it on the worker threads, in contiguous shards.
+    // Sending them happens below on this thread, in the same order as before, so the stream is the same for any thread count.
+    bool threaded = replication_workers.getThreadCount() > 0;
+    if (threaded)
+    {
+        if (object_updates.size() < replication_objects.size())
+            object_updates.resize(replication_objects.size());
+        size_t shard_count = std::min(replication_objects.size(), size_t(replication_workers.getThreadCount() + 1) * 4);
+        replication_workers.run(shard_count, [this, delta, shard_count](size_t shard)
+        {
+            size_t begin = replication_objects.size() * shard / shard_count;
+            size_t end = replication_objects.size() * (shard + 1) / shard_count;
+            for(size_t n=begin; n<end; n++)
+            {
+                ObjectUpdate& update = object_updates[n];
+                update.done = replication_objects[n]->replication_thread_safe;
+                if (update.done)
+                    buildUpdatePacket(replication_objects[n], delta, update.packet, update.member_ranges);
+            }
+        });
+    }
+    sp::io::DataBuffer update_packet;
+    for(size_t index=0; index<replication_objects.size(); index++)
+    {
+        MultiplayerObject* obj = replication_objects[index];
+        sp::io::DataBuffer* packet = &update_packet;
+        bool changed;
+        if (threaded && object_updates[index].done)
+        {
+            packet = &object_updates[index].packet;
+            update_member_ranges.swap(object_updates[index].member_ranges);
+            changed = !update_member_ranges.empty();
+        }else{
+            inline_table_strings = isVisibilityRestricted(obj);
+            changed = buildUpdatePacket(obj, delta, update_packet, update_member_ranges);
+            inline_table_strings = false;
+        }
+        if (changed)
+        {
+            sendUpdate(obj, *packet);
+            for(const auto& member : update_member_ranges)
+            {
+                obj->memberReplicationInfo[member.index].change_tick = replication_tick;
+#ifdef DEBUG
+                replication_profiler.addMember(obj->profiler_class_index, member.index, obj->memberReplicationInfo[member.index].name, member.end - member.start);
+#else
+                replication_profiler.addMember(obj->profiler_class_index, member.index, nullptr, member.end - member.start);
+#endif
+            }
+            replication_profiler.addUpdateOverhead(obj->profiler_class_index, update_member_ranges.front().start);
+        }
+    }
+    updateVisibility();
     for(unsigned int n=0; n<delList.size(); n++)
     {
         sp::io::DataBuffer packet;
         generateDeletePacketFor(delList[n], packet);
-        sendAll(packet);
-        ADD_MULTIPLAYER_STATS("???::DELETE", packet.getDataSize());
+        sendObjectPacket(delList[n], packet);
+        for(auto& client : clientList)
+        {
+            client.pending_member_updates.erase(delList[n]);
+            client.lod_next_update.erase(delList[n]);
+            client.lod_deferred_updates.erase(delList[n]);
+            client.hidden_objects.erase(delList[n]);
+            client.shown_ticks.erase(delList[n]);
+        }
+        replication_profiler.addDelete(packet.getDataSize());
         objectMap.erase(delList[n]);
+        if (session_resume_time > 0.0f)
+            deleted_objects.push_back({replication_tick, delList[n]});
     }
+    acknowledgeClientCommands();
 
     handleBroadcastUDPSocket(delta);
+    expireSessions();
 
-    if (listenSocket.accept(*new_socket))
+    //Drain the listen backlog, so a burst of reconnecting clients is not accepted one per update.
+    for(int accepted=0; accepted<multiplayerMaxAcceptsPerUpdate && listenSocket.accept(*new_socket); accepted++)
     {
         new_socket->setBlocking(false);
         new_socket->setDelay(false);
         ClientInfo info;
         info.socket = std::move(new_socket);
         new_socket = std::make_unique<sp::io::network::TcpSocket>();
-        info.client_id = nextclient_id;
-        info.receive_state = CRS_Auth;
-        nextclient_id++;
+        initClientInfo(info);
         {
             sp::io::DataBuffer packet;
             packet << CMD_REQUEST_AUTH << int32_t(version_number) << bool(server_password != "");
@@ -236,13 +330,27 @@ void GameServer::update(float /*gameDelta*/)
                             int32_t client_version;
                             string client_password;
                             packet >> client_version >> client_password;
+                            //A reconnecting client adds the session it wants to resume.
+                            int32_t resume_client_id = -1;
+                            uint32_t resume_token_high = 0;
+                            uint32_t resume_token_low = 0;
+                            uint32_t resume_tick = 0;
+                            if (packet.available())
+                                packet >> resume_client_id >> resume_token_high >> resume_token_low >> resume_tick;
+                            //A GameServerProxy marks itself, only the clients behind it are clients of the game.
+                            bool is_proxy = false;
+                            if (packet.available())
+                                packet >> is_proxy;
 
                             if (version_number == client_version || version_number == 0 || client_version == 0)
                             {
                                 if (server_password == "" || client_password == server_password)
                                 {
                                     clientList[n].receive_state = CRS_Main;
-                                    handleNewClient(clientList[n]);
+                                    clientList[n].is_proxy = is_proxy;
+                                    uint64_t resume_token = (uint64_t(resume_token_high) << 32) | resume_token_low;
+                                    if (!resumeSession(clientList[n], resume_client_id, resume_token, resume_tick))
+                                        handleNewClient(clientList[n]);
                                 }else{
                                     //Wrong password, send a new auth request so the client knows the password was not accepted.
                                     sp::io::DataBuffer auth_request_packet;
@@ -262,6 +370,10 @@ void GameServer::update(float /*gameDelta*/)
                             clientList[n].ping = clientList[n].round_trip_start_time.get() * 1000.0f;
                         }
                         break;
+                    case CMD_TIME_SYNC:
+                    case CMD_TIME_SYNC_RESP:
+                        handleTimeSync(clientList[n], command, packet);
+                        break;
                     default:
                         LOG(ERROR) << "Unknown command from client while authenticating: " << command;
                         clientList[n].socket->close();
@@ -279,8 +391,14 @@ void GameServer::update(float /*gameDelta*/)
                     case CMD_NEW_PROXY_CLIENT:
                         {
                             int32_t temp_id = 0;
+                            bool world_cached = false;
+                            bool relay = false;
                             packet >> temp_id;
-                            handleNewProxy(clientList[n], temp_id);
+                            if (packet.available())
+                                packet >> world_cached;
+                            if (packet.available())
+                                packet >> relay;
+                            handleNewProxy(clientList[n], temp_id, world_cached, relay);
                         }
                         break;
                     case CMD_DEL_PROXY_CLIENT:
@@ -291,26 +409,25 @@ void GameServer::update(float /*gameDelta*/)
                             {
                                 if (id == client_id)
                                 {
-                                    onDisconnectClient(client_id);
+                                    onClientDisconnected(client_id, DisconnectReason::ConnectionClosed);
                                 }
                             }
                             clientList[n].proxy_ids.erase(std::remove_if(clientList[n].proxy_ids.begin(), clientList[n].proxy_ids.end(), [client_id](int32_t id) {return id == client_id;}), clientList[n].proxy_ids.end());
+                            clientList[n].command_sequences.erase(client_id);
                         }
                         break;
                     case CMD_CLIENT_COMMAND:
-                        packet >> clientList[n].command_object_id;
-                        clientList[n].command_client_id = clientList[n].client_id;
-                        clientList[n].receive_state = CRS_Command;
+                        handleClientCommands(clientList[n], clientList[n].client_id, packet);
                         break;
                     case CMD_PROXY_CLIENT_COMMAND:
                         {
                             int32_t client_id = 0;
-                            packet >> clientList[n].command_object_id >> client_id;
-                            clientList[n].command_client_id = clientList[n].client_id;
+                            packet >> client_id;
+                            int32_t command_client_id = clientList[n].client_id;
                             for(auto id : clientList[n].proxy_ids)
                                 if (id == client_id)
-                                    clientList[n].command_client_id = client_id;
-                            clientList[n].receive_state = CRS_Command;
+                                    command_client_id = client_id;
+                            handleClientCommands(clientList[n], command_client_id, packet);
                         }
                         break;
                     case CMD_AUDIO_COMM_START:
@@ -331,22 +448,20 @@ void GameServer::update(float /*gameDelta*/)
                         }
                         break;
                     case CMD_AUDIO_COMM_DATA:
-                        if (packet.getDataSize() > sizeof(int32_t) + sizeof(command_t))
                         {
-                            int32_t client_id;
+                            int32_t client_id = 0;
                             packet >> client_id;
-
-                            const unsigned char* ptr = reinterpret_cast<const unsigned char*>(packet.getData());
-                            ptr += sizeof(int32_t) + sizeof(command_t);
+                            if (packet.available() < 1)
+                                break;
                             if (client_id == clientList[n].client_id)
                             {
-                                gotAudioPacket(client_id, ptr, static_cast<int>(packet.getDataSize()) - sizeof(int32_t) - sizeof(command_t));
+                                forwardAudioPacket(client_id, packet);
                             }
                             else
                             {
                                 for(auto id : clientList[n].proxy_ids)
                                     if (id == client_id)
-                                        gotAudioPacket(client_id, ptr, static_cast<int>(packet.getDataSize()) - sizeof(int32_t) - sizeof(command_t));
+                                        forwardAudioPacket(client_id, packet);
                             }
                         }
                         break;
@@ -371,67 +486,183 @@ void GameServer::update(float /*gameDelta*/)
                             clientList[n].ping = clientList[n].round_trip_start_time.get() * 1000.0f;
                         }
                     break;
+                    case CMD_TIME_SYNC:
+                    case CMD_TIME_SYNC_RESP:
+                        handleTimeSync(clientList[n], command, packet);
+                        break;
                     default:
                         LOG(ERROR) << "Unknown command from client: " << command;
                     }
                 }
                 break;
-            case CRS_Command:
-                if (objectMap.find(clientList[n].command_object_id) != objectMap.end() && objectMap[clientList[n].command_object_id])
-                    objectMap[clientList[n].command_object_id]->onReceiveClientCommand(clientList[n].command_client_id, packet);
-                clientList[n].receive_state = CRS_Main;
-                break;
             }
         }
         if (clientList[n].socket != NULL) {
             clientList[n].socket->sendSendQueue();
+            if (clientList[n].socket->getSendQueueSize() > clientList[n].send_queue_hard_limit)
+            {
+                LOG(WARNING) << "Client " << clientList[n].client_id << " send queue exceeded " << clientList[n].send_queue_hard_limit << " bytes, disconnecting";
+                clientList[n].disconnect_reason = DisconnectReason::SendQueueOverflow;
+                clientList[n].socket->close();
+            }
+            else if (clientList[n].socket->getSendQueueSize() <= clientList[n].send_queue_high_water_mark)
+            {
+                sendPendingMemberUpdates(clientList[n]);
+                sendDueLodUpdates(clientList[n]);
+                sendPendingCreates(clientList[n]);
+            }
         }
         if (clientList[n].socket == NULL || !clientList[n].socket->isConnected())
         {
             if (clientList[n].socket)
-            {
-                for(auto id : clientList[n].proxy_ids)
-                    onDisconnectClient(id);
-                onDisconnectClient(clientList[n].client_id);
-            }
+                disconnectClient(clientList[n]);
             clientList.erase(clientList.begin() + n);
             n--;
         }
     }
+    pruneDeletedObjects();
 
     
     if (keep_alive_send_timer.isExpired())
     {
         keepAliveAll();
     }
+    if (time_sync_send_timer.isExpired())
+    {
+        sendTimeSyncAll();
+    }
+    if (recorder)
+    {
+        if (recording_keyframe_timer.isExpired())
+            writeRecordingKeyframe();
+        recorder->writeTick(getServerTime());
+    }
 
+    //Exponential moving average with a time constant of 1 second, weighted so long frames do not overshoot.
+    float rate_weight = 1.f - std::exp(-delta);
     float dataPerSecond = float(sendDataCounter) / delta;
-    sendDataRate = sendDataRate * (1.f - delta) + dataPerSecond * delta;
+    sendDataRate = sendDataRate * (1.f - rate_weight) + dataPerSecond * rate_weight;
     dataPerSecond = float(sendDataCounterPerClient) / delta;
-    sendDataRatePerClient = sendDataRatePerClient * (1.f - delta) + dataPerSecond * delta;
+    sendDataRatePerClient = sendDataRatePerClient * (1.f - rate_weight) + dataPerSecond * rate_weight;
+
+    update_run_time = update_run_time_clock.get();
+}
+
+void GameServer::initClientInfo(ClientInfo& info)
+{
+    info.client_id = nextclient_id;
+    info.receive_state = CRS_Auth;
+    info.send_queue_high_water_mark = send_queue_high_water_mark;
+    info.send_queue_hard_limit = send_queue_hard_limit;
+    nextclient_id++;
+}
+
+//The token is the only credential for taking over a session, so every token comes straight from the system random source.
+static uint64_t generateSessionToken()
+{
+    std::random_device random;
+    uint64_t token = 0;
+    while(token == 0)
+        token = (uint64_t(random()) << 32) | uint64_t(random());
+    return token;
+}
+
+void GameServer::disconnectClient(ClientInfo& info)
+{
+    for(auto id : info.proxy_ids)
+        onClientDisconnected(id, info.disconnect_reason);
+    //A client that has acknowledged a tick can resume from it, the game only hears of the disconnect when it does not come back in time.
+    if (info.session_token != 0 && info.acked_tick != 0 && session_resume_time > 0.0f)
+    {
+        ResumableSession session;
+        session.client_id = info.client_id;
+        session.token = info.session_token;
+        session.acked_tick = info.acked_tick;
+        session.disconnect_reason = info.disconnect_reason;
+        session.expire_timer.start(session_resume_time);
+        session.visibility_mask = info.visibility_mask;
+        session.focus_object = info.focus_object;
+        session.hidden_objects = std::move(info.hidden_objects);
+        session.shown_ticks = std::move(info.shown_ticks);
+        resumable_sessions.push_back(std::move(session));
+        LOG(INFO) << "Client " << info.client_id << " disconnected, keeping its session for " << session_resume_time << " seconds";
+    }else if (!info.is_proxy){
+        onClientDisconnected(info.client_id, info.disconnect_reason);
+    }
+}
+
+bool GameServer::resumeSession(ClientInfo& info, int32_t client_id, uint64_t token, uint32_t acked_tick)
+{
+    if (token == 0 || session_resume_time <= 0.0f)
+        return false;
+    //The old connection might not be noticed as closed yet, the new connection takes over its session.
+    for(auto& client : clientList)
+    {
+        if (&client != &info && client.socket && client.client_id == client_id && client.session_token == token)
+        {
+            client.socket->close();
+            disconnectClient(client);
+            client.socket = nullptr;
+        }
+    }
+    auto session = std::find_if(resumable_sessions.begin(), resumable_sessions.end(), [client_id, token](const ResumableSession& s) { return s.client_id == client_id && s.token == token; });
+    if (session == resumable_sessions.end())
+        return false;
+    ResumableSession resumed = std::move(*session);
+    resumable_sessions.erase(session);
+    //Deletes before deleted_objects_start_tick are forgotten, so the client can only resume from a tick after it.
+    if (acked_tick == 0 || acked_tick < deleted_objects_start_tick || acked_tick > replication_tick)
+    {
+        LOG(INFO) << "Client " << client_id << " cannot resume from tick " << acked_tick << ", starting a new session";
+        onClientDisconnected(resumed.client_id, resumed.disconnect_reason);
+        return false;
+    }
+    LOG(INFO) << "Client " << client_id << " resumed its session from tick " << acked_tick;
+    info.client_id = client_id;
+    info.session_token = token;
+    info.acked_tick = acked_tick;
+    info.visibility_mask = resumed.visibility_mask;
+    info.focus_object = resumed.focus_object;
+    info.shown_ticks = std::move(resumed.shown_ticks);
+    handleResumedClient(info, acked_tick, resumed.hidden_objects);
+    return true;
+}
 
-#if MULTIPLAYER_COLLECT_DATA_STATS
-    if (multiplayer_stats_dump.isExpired())
+void GameServer::expireSessions()
+{
+    for(unsigned int n=0; n<resumable_sessions.size(); n++)
     {
-        int total = 0;
-        for(std::unordered_map<string, int >::iterator i=multiplayer_stats.begin(); i != multiplayer_stats.end(); i++)
-            total += i->second;
-        printf("---------------------------------Total: %d\n", total);
-        for(std::unordered_map<string, int >::iterator i=multiplayer_stats.begin(); i != multiplayer_stats.end(); i++)
+        if (resumable_sessions[n].expire_timer.isExpired())
         {
-            printf("%60s: %d (%d%%)\n", i->first.c_str(), i->second, i->second * 100 / total);
+            ResumableSession session = resumable_sessions[n];
+            resumable_sessions.erase(resumable_sessions.begin() + n);
+            n--;
+            onClientDisconnected(session.client_id, session.disconnect_reason);
         }
-        multiplayer_stats.clear();
     }
-#endif
-    update_run_time = update_run_time_clock.get();
+}
+
+void GameServer::pruneDeletedObjects()
+{
+    //Only deletes after the oldest tick a client could resume from are needed.
+    uint32_t oldest_tick = replication_tick;
+    for(auto& client : clientList)
+        if (client.socket && client.session_token != 0 && client.acked_tick != 0)
+            oldest_tick = std::min(oldest_tick, client.acked_tick);
+    for(auto& session : resumable_sessions)
+        oldest_tick = std::min(oldest_tick, session.acked_tick);
+    while(!deleted_objects.empty() && deleted_objects.front().tick <= oldest_tick)
+        deleted_objects.pop_front();
+    deleted_objects_start_tick = std::max(deleted_objects_start_tick, oldest_tick);
 }
 
 void GameServer::handleNewClient(ClientInfo& info)
 {
+    if (session_resume_time > 0.0f && !info.is_proxy)
+        info.session_token = generateSessionToken();
     {
         sp::io::DataBuffer packet;
-        packet << CMD_SET_CLIENT_ID << info.client_id;
+        packet << CMD_SET_CLIENT_ID << info.client_id << uint32_t(info.session_token >> 32) << uint32_t(info.session_token) << session_resume_time << false;
         info.socket->queue(packet);
     }
     {
@@ -439,55 +670,190 @@ void GameServer::handleNewClient(ClientInfo& info)
         packet << CMD_SET_GAME_SPEED << lastGameSpeed;
         info.socket->queue(packet);
     }
+    sendStringTable(info);
 
-    onNewClient(info.client_id);
+    if (!info.is_proxy)
+        onNewClient(info.client_id);
+    //A visibility mask set in onNewClient is already used for the creates below.
+    info.visibility_changed = false;
 
-    //On a new client, first create all the already existing objects. And update all the values.
+    //On a new client, first create all the already existing objects, with all their current values.
+    // This is spread over the next updates by sendPendingCreates, so a join does not stall the server or the queue of the client.
+    // The client already gets all updates in the meantime, updates for objects it does not have yet are ignored by it.
+    // Objects it cannot see are hidden right away, so their updates and commands are not send while the creates are still pending.
     for(std::unordered_map<int32_t, P<MultiplayerObject> >::iterator i=objectMap.begin(); i != objectMap.end(); i++)
     {
         P<MultiplayerObject> obj = i->second;
-        if (obj && obj->replicated)
+        if (!obj || !obj->replicated)
+            continue;
+        if (isObjectVisibleTo(info, *obj))
+            info.pending_creates.push_back(i->first);
+        else
+            info.hidden_objects[i->first] = replication_tick;
+    }
+    sendPendingCreates(info);
+}
+
+void GameServer::handleResumedClient(ClientInfo& info, uint32_t acked_tick, const std::unordered_map<int32_t, uint32_t>& hidden_objects)
+{
+    {
+        sp::io::DataBuffer packet;
+        packet << CMD_SET_CLIENT_ID << info.client_id << uint32_t(info.session_token >> 32) << uint32_t(info.session_token) << session_resume_time << true;
+        info.socket->queue(packet);
+    }
+    {
+        sp::io::DataBuffer packet;
+        packet << CMD_SET_GAME_SPEED << lastGameSpeed;
+        info.socket->queue(packet);
+    }
+    sendStringTable(info);
+
+    //Objects hidden since before the acknowledged tick were never on the client.
+    auto was_hidden = [&hidden_objects, acked_tick](int32_t id)
+    {
+        auto it = hidden_objects.find(id);
+        return it != hidden_objects.end() && it->second <= acked_tick;
+    };
+    for(auto& deleted : deleted_objects)
+    {
+        if (deleted.tick <= acked_tick || was_hidden(deleted.id))
+            continue;
+        sp::io::DataBuffer packet;
+        generateDeletePacketFor(deleted.id, packet);
+        info.socket->queue(packet);
+    }
+    //Objects created after the acknowledged tick are created like for a joining client, the client ignores the ones it already got.
+    // Of all objects the members send after that tick go out with their current value.
+    for(std::unordered_map<int32_t, P<MultiplayerObject> >::iterator i=objectMap.begin(); i != objectMap.end(); i++)
+    {
+        P<MultiplayerObject> obj = i->second;
+        if (!obj || !obj->replicated)
+            continue;
+        if (!isObjectVisibleTo(info, *obj))
+        {
+            if (was_hidden(i->first))
+            {
+                info.hidden_objects[i->first] = hidden_objects.find(i->first)->second;
+            }else{
+                info.hidden_objects[i->first] = replication_tick;
+                sp::io::DataBuffer packet;
+                generateDeletePacketFor(i->first, packet);
+                info.socket->queue(packet);
+            }
+            continue;
+        }
+        //Hidden or shown again after the acknowledged tick, the client might have an outdated copy, so it is created anew.
+        auto shown = info.shown_ticks.find(i->first);
+        bool hidden_since = hidden_objects.find(i->first) != hidden_objects.end() && !was_hidden(i->first);
+        if (hidden_since || (shown != info.shown_ticks.end() && shown->second > acked_tick))
         {
             sp::io::DataBuffer packet;
-            generateCreatePacketFor(obj, packet);
+            generateDeletePacketFor(i->first, packet);
+            info.socket->queue(packet);
+            info.pending_creates.push_back(i->first);
+        }
+        else if (obj->create_tick > acked_tick || was_hidden(i->first))
+        {
+            info.pending_creates.push_back(i->first);
+        }
+        sp::io::DataBuffer packet;
+        packet << CMD_UPDATE_VALUE << obj->multiplayerObjectId;
+        size_t header_size = packet.getDataSize();
+        inline_table_strings = isVisibilityRestricted(*obj);
+        for(unsigned int n=0; n<obj->memberReplicationInfo.size(); n++)
+        {
+            if (obj->memberReplicationInfo[n].change_tick <= acked_tick)
+                continue;
+            writeMember(*obj, n, packet);
+        }
+        inline_table_strings = false;
+        if (packet.getDataSize() > header_size)
+        {
             sendDataCounter += packet.getDataSize();
             info.socket->queue(packet);
         }
     }
+    sendPendingCreates(info);
 }
 
-void GameServer::handleNewProxy(ClientInfo& info, int32_t temp_id)
+void GameServer::handleNewProxy(ClientInfo& info, int32_t temp_id, bool world_cached, bool relay)
 {
-    info.proxy_ids.push_back(nextclient_id);
+    int32_t client_id = nextclient_id++;
+    //A proxy chained behind the proxy only relays the world, it gets an id but is not a client of the game.
+    if (!relay)
+        info.proxy_ids.push_back(client_id);
     {
         sp::io::DataBuffer packet;
-        packet << CMD_SET_PROXY_CLIENT_ID << temp_id << nextclient_id;
+        packet << CMD_SET_PROXY_CLIENT_ID << temp_id << client_id;
         info.socket->queue(packet);
-        nextclient_id++;
+    }
+    //A proxy with a world cache sends the game speed, string table and objects to the new client itself.
+    if (world_cached)
+    {
+        if (!relay)
+            onNewClient(client_id);
+        return;
     }
     {
         sp::io::DataBuffer packet;
         packet << CMD_SET_GAME_SPEED << lastGameSpeed;
         info.socket->queue(packet);
     }
+    sendStringTable(info);
 
-    onNewClient(info.proxy_ids.back());
+    if (!relay)
+        onNewClient(client_id);
 
-    //On a new client, first create all the already existing objects. And update all the values.
+    //On a new client, first create all the already existing objects, with all their current values.
+    // This is spread over the next updates by sendPendingCreates, so a join does not stall the server or the queue of the client.
+    // The client already gets all updates in the meantime, updates for objects it does not have yet are ignored by it.
+    // Objects it cannot see are hidden right away, so their updates and commands are not send while the creates are still pending.
     for(std::unordered_map<int32_t, P<MultiplayerObject> >::iterator i=objectMap.begin(); i != objectMap.end(); i++)
     {
         P<MultiplayerObject> obj = i->second;
-        if (obj && obj->replicated)
+        if (!obj || !obj->replicated)
+            continue;
+        if (isObjectVisibleTo(info, *obj))
+            info.pending_creates.push_back(i->first);
+        else
+            info.hidden_objects[i->first] = replication_tick;
+    }
+    sendPendingCreates(info);
+}
+
+
+void GameServer::handleClientCommands(ClientInfo& info, int32_t client_id, sp::io::DataBuffer& packet)
+{
+    //A single frame can hold a batch of commands, each as: object id, sequence number, payload size, payload.
+    auto& sequence = info.command_sequences[client_id];
+    while(packet.available())
+    {
+        int32_t object_id = 0;
+        uint32_t command_sequence = 0;
+        uint32_t size = 0;
+        sp::io::DataView data;
+        packet >> object_id >> command_sequence >> size;
+        if (!packet.readView(data, size))
         {
-            sp::io::DataBuffer packet;
-            generateCreatePacketFor(obj, packet);
-            sendDataCounter += packet.getDataSize();
-            info.socket->queue(packet);
+            LOG(ERROR) << "Truncated client command from client: " << client_id;
+            break;
+        }
+        sequence.received = std::max(sequence.received, command_sequence);
+
+        auto it = objectMap.find(object_id);
+        if (it != objectMap.end() && it->second)
+        {
+            P<MultiplayerObject> obj = it->second;
+            sp::io::DataBuffer command;
+            command.appendRaw(data.getData(), data.getDataSize());
+            obj->onReceiveClientCommand(client_id, command);
+            //The predicting client needs the full state of the object before the acknowledgement, to replay its pending commands on.
+            if (obj->client_prediction)
+                info.predicted_command_objects.insert(object_id);
         }
     }
 }
 
-
 void GameServer::handleBroadcastUDPSocket(float delta)
 {
     sp::io::network::Address recvAddress;
@@ -519,6 +885,7 @@ void GameServer::registerObject(P<MultiplayerObject> obj)
     // This due to the fact that in C++ does not "is" it's final sub-class till construction is completed.
     obj->multiplayerObjectId = nextObjectId;
     obj->replicated = false;
+    obj->profiler_class_index = replication_profiler.internClass(obj->multiplayerClassIdentifier);
     nextObjectId++;
 
     objectMap[obj->multiplayerObjectId] = obj;
@@ -531,13 +898,23 @@ void GameServer::setPassword(string password)
 
 void GameServer::generateCreatePacketFor(P<MultiplayerObject> obj, sp::io::DataBuffer& packet)
 {
-    packet << CMD_CREATE << obj->multiplayerObjectId << obj->multiplayerClassIdentifier;
+    inline_table_strings = isVisibilityRestricted(*obj);
+    packet << CMD_CREATE << obj->multiplayerObjectId;
+    writeTableString(packet, obj->multiplayerClassIdentifier);
 
     for(unsigned int n=0; n<obj->memberReplicationInfo.size(); n++)
-    {
-        packet << int16_t(n);
-        (obj->memberReplicationInfo[n].sendFunction)(obj->memberReplicationInfo[n].ptr, packet);
-    }
+        writeMember(*obj, n, packet);
+    inline_table_strings = false;
+}
+
+void GameServer::writeMember(MultiplayerObject* obj, unsigned int index, sp::io::DataBuffer& packet)
+{
+    auto& info = obj->memberReplicationInfo[index];
+    packet << int16_t(index);
+    size_t data_start = packet.reserveVLQ();
+    (info.sendFunction)(info.ptr, packet);
+    uint32_t table_string = info.sendFunction == &multiplayerReplicationFunctions<string>::sendData ? 1 : 0;
+    packet.writeVLQBefore(data_start, uint32_t(packet.getDataSize() - data_start) << 1 | table_string);
 }
 
 void GameServer::generateDeletePacketFor(int32_t id, sp::io::DataBuffer& packet)
@@ -550,7 +927,7 @@ void GameServer::broadcastServerCommandFromObject(int32_t id, sp::io::DataBuffer
     sp::io::DataBuffer p;
     p << CMD_SERVER_COMMAND << id;
     p.appendRaw(packet.getData(), packet.getDataSize());
-    sendAll(p);
+    sendObjectPacket(id, p);
 }
 
 void GameServer::keepAliveAll()
@@ -568,9 +945,219 @@ void GameServer::keepAliveAll()
     }
 }
 
+void GameServer::acknowledgeClientCommands()
+{
+    for(auto& client : clientList)
+    {
+        if (client.receive_state == CRS_Auth || !client.socket)
+            continue;
+        //Acknowledge only once the client has the state that goes with it.
+        if (!client.pending_member_updates.empty())
+            continue;
+        //Only the commanding client gets the full state of its predicted objects, the others get the normal updates.
+        for(int32_t object_id : client.predicted_command_objects)
+        {
+            auto it = objectMap.find(object_id);
+            if (it == objectMap.end() || !it->second || !it->second->replicated || client.hidden_objects.find(object_id) != client.hidden_objects.end())
+                continue;
+            MultiplayerObject* obj = *it->second;
+            sp::io::DataBuffer packet;
+            packet << CMD_UPDATE_VALUE << object_id;
+            inline_table_strings = isVisibilityRestricted(obj);
+            for(unsigned int n=0; n<obj->memberReplicationInfo.size(); n++)
+                writeMember(obj, n, packet);
+            inline_table_strings = false;
+            sendDataCounter += packet.getDataSize();
+            client.socket->queue(packet);
+        }
+        client.predicted_command_objects.clear();
+        for(auto& it : client.command_sequences)
+        {
+            if (it.second.acknowledged == it.second.received)
+                continue;
+            it.second.acknowledged = it.second.received;
+            if (it.first != client.client_id)
+            {
+                sp::io::DataBuffer target_packet;
+                target_packet << CMD_PROXY_TO_CLIENTS << it.first;
+                client.socket->queue(target_packet);
+            }
+            sp::io::DataBuffer packet;
+            packet << CMD_CLIENT_COMMAND_ACK << it.second.acknowledged;
+            client.socket->queue(packet);
+        }
+    }
+}
+
+void GameServer::sendTimeSyncAll()
+{
+    double server_time = getServerTime();
+    sp::io::DataBuffer packet;
+    packet << CMD_TIME_SYNC << server_time;
+    //Clients with a session that have been send everything up to this tick also get the tick, which they acknowledge for resuming.
+    sp::io::DataBuffer tick_packet;
+    tick_packet << CMD_TIME_SYNC << server_time << replication_tick;
+    for(auto& client : clientList)
+    {
+        if (client.receive_state == CRS_Auth || !client.socket)
+            continue;
+        if (client.session_token != 0 && client.pending_member_updates.empty() && client.pending_creates.empty())
+        {
+            if (client.lod_deferred_updates.empty())
+            {
+                client.socket->queue(tick_packet);
+                continue;
+            }
+            //Values held back by a LOD tier are not send yet, only the ticks before the oldest of them are complete.
+            uint32_t tick = replication_tick;
+            for(auto& it : client.lod_deferred_updates)
+                tick = std::min(tick, it.second.first_tick - 1);
+            sp::io::DataBuffer lod_tick_packet;
+            lod_tick_packet << CMD_TIME_SYNC << server_time << tick;
+            client.socket->queue(lod_tick_packet);
+        }else{
+            client.socket->queue(packet);
+        }
+    }
+}
+
+void GameServer::handleTimeSync(ClientInfo& info, uint16_t command, sp::io::DataBuffer& packet)
+{
+    if (command == CMD_TIME_SYNC)
+    {
+        double client_time = 0.0;
+        packet >> client_time;
+        sp::io::DataBuffer reply;
+        reply << CMD_TIME_SYNC_RESP << client_time << getServerTime();
+        info.socket->queue(reply);
+    }else{
+        double send_time = 0.0;
+        double client_time = 0.0;
+        packet >> send_time >> client_time;
+        info.timing.addSample(send_time, client_time, getServerTime());
+        if (packet.available())
+        {
+            uint32_t tick = 0;
+            packet >> tick;
+            if (tick <= replication_tick)
+                info.acked_tick = std::max(info.acked_tick, tick);
+        }
+        info.ping = info.timing.getRoundTripTime() * 1000.0f;
+    }
+}
+
+GameServer::ClientInfo* GameServer::findClientConnection(int32_t client_id)
+{
+    for(auto& client : clientList)
+    {
+        if (client.client_id == client_id)
+            return &client;
+        for(auto id : client.proxy_ids)
+            if (id == client_id)
+                return &client;
+    }
+    return nullptr;
+}
+
+float GameServer::getClientRoundTripTime(int32_t client_id)
+{
+    auto info = findClientConnection(client_id);
+    if (!info)
+        return 0.0f;
+    return info->timing.getRoundTripTime();
+}
+
+float GameServer::getClientJitter(int32_t client_id)
+{
+    auto info = findClientConnection(client_id);
+    if (!info)
+        return 0.0f;
+    return info->timing.getJitter();
+}
+
+double GameServer::getClientClockOffset(int32_t client_id)
+{
+    auto info = findClientConnection(client_id);
+    if (!info)
+        return 0.0;
+    return info->timing.getClockOffset();
+}
+
+std::vector<int32_t> GameServer::getClientIds()
+{
+    std::vector<int32_t> result;
+    for(auto& client : clientList)
+    {
+        if (client.receive_state == CRS_Auth)
+            continue;
+        if (client.proxy_ids.empty() && !client.is_proxy)
+            result.push_back(client.client_id);
+        result.insert(result.end(), client.proxy_ids.begin(), client.proxy_ids.end());
+    }
+    return result;
+}
+
+GameServer::ClientStatistics GameServer::getClientStatistics(int32_t client_id)
+{
+    ClientStatistics result;
+    auto info = findClientConnection(client_id);
+    if (!info || !info->socket)
+        return result;
+    const auto& socket_statistics = info->socket->getStatistics();
+    result.bytes_sent = socket_statistics.bytes_sent;
+    result.bytes_received = socket_statistics.bytes_received;
+    result.frames_sent = socket_statistics.frames_sent;
+    result.frames_received = socket_statistics.frames_received;
+    result.send_queue_size = info->socket->getSendQueueSize();
+    result.peak_send_queue_size = socket_statistics.peak_send_queue_size;
+    result.round_trip_time = info->timing.getRoundTripTime();
+    result.dropped_updates = info->dropped_updates;
+    result.deferred_updates = info->deferred_updates;
+    result.pending_creates = info->pending_creates.size() - info->next_pending_create;
+    return result;
+}
+
+static int getNetworkClientIds(lua_State* L)
+{
+    if (!game_server)
+        return 0;
+    return convert<std::vector<int32_t>>::returnType(L, game_server->getClientIds());
+}
+/// getNetworkClientIds()
+/// Returns a list of the ids of all clients connected to this server.
+REGISTER_SCRIPT_FUNCTION(getNetworkClientIds);
+
+static int getNetworkClientStatistics(lua_State* L)
+{
+    int32_t client_id = static_cast<int32_t>(luaL_checkinteger(L, 1));
+    if (!game_server)
+        return 0;
+    auto stats = game_server->getClientStatistics(client_id);
+    //Doubles, so the byte and frame counters of long sessions stay exact.
+    std::map<string, double> result;
+    result["bytes_sent"] = stats.bytes_sent;
+    result["bytes_received"] = stats.bytes_received;
+    result["frames_sent"] = stats.frames_sent;
+    result["frames_received"] = stats.frames_received;
+    result["send_queue_size"] = stats.send_queue_size;
+    result["peak_send_queue_size"] = stats.peak_send_queue_size;
+    result["round_trip_time"] = stats.round_trip_time;
+    result["dropped_updates"] = stats.dropped_updates;
+    result["deferred_updates"] = stats.deferred_updates;
+    result["compression_ratio"] = stats.compression_ratio;
+    result["pending_creates"] = stats.pending_creates;
+    return convert<std::map<string, double>>::returnType(L, result);
+}
+/// getNetworkClientStatistics(client_id)
+/// Returns a table with the network statistics of the connection of a client.
+/// Keys: bytes_sent, bytes_received, frames_sent, frames_received, send_queue_size, peak_send_queue_size, round_trip_time, dropped_updates, deferred_updates, compression_ratio, pending_creates
+REGISTER_SCRIPT_FUNCTION(getNetworkClientStatistics);
+
 void GameServer::sendAll(sp::io::DataBuffer& packet)
 {
     sendDataCounterPerClient += packet.getDataSize();
+    if (recorder)
+        recorder->writeFrame(getServerTime(), packet);
     for(auto& client : clientList)
     {
         if (client.receive_state != CRS_Auth && client.socket)
@@ -578,6 +1165,577 @@ void GameServer::sendAll(sp::io::DataBuffer& packet)
     }
 }
 
+void GameServer::sendObjectPacket(int32_t object_id, sp::io::DataBuffer& packet)
+{
+    sendDataCounterPerClient += packet.getDataSize();
+    if (recorder)
+        recorder->writeFrame(getServerTime(), packet);
+    for(auto& client : clientList)
+    {
+        if (client.receive_state != CRS_Auth && client.socket && client.hidden_objects.find(object_id) == client.hidden_objects.end())
+            client.socket->queue(packet);
+    }
+}
+
+bool GameServer::isVisibilityRestricted(MultiplayerObject* obj)
+{
+    return obj->replication_visibility_mask != multiplayerVisibleToAll || !obj->replication_visible_clients.empty();
+}
+
+bool GameServer::isObjectVisibleTo(const ClientInfo& info, MultiplayerObject* obj)
+{
+    if (!obj->replication_visible_clients.empty())
+    {
+        for(auto id : obj->replication_visible_clients)
+        {
+            if (id == info.client_id)
+                return true;
+            for(auto proxy_id : info.proxy_ids)
+                if (id == proxy_id)
+                    return true;
+        }
+        return false;
+    }
+    return (obj->replication_visibility_mask & info.visibility_mask) != 0;
+}
+
+bool GameServer::isObjectVisibleToAnyClient(MultiplayerObject* obj)
+{
+    for(auto& client : clientList)
+        if (client.receive_state != CRS_Auth && client.socket && isObjectVisibleTo(client, obj))
+            return true;
+    //A client that might resume needs the change ticks of the objects it can see.
+    for(auto& session : resumable_sessions)
+    {
+        if (!obj->replication_visible_clients.empty())
+        {
+            if (std::find(obj->replication_visible_clients.begin(), obj->replication_visible_clients.end(), session.client_id) != obj->replication_visible_clients.end())
+                return true;
+        }
+        else if (obj->replication_visibility_mask & session.visibility_mask)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void GameServer::applyVisibility(ClientInfo& info, MultiplayerObject* obj)
+{
+    int32_t id = obj->multiplayerObjectId;
+    bool visible = isObjectVisibleTo(info, obj);
+    auto hidden = info.hidden_objects.find(id);
+    if (visible && hidden != info.hidden_objects.end())
+    {
+        info.hidden_objects.erase(hidden);
+        info.shown_ticks[id] = replication_tick;
+        sp::io::DataBuffer packet;
+        generateCreatePacketFor(obj, packet);
+        sendDataCounter += packet.getDataSize();
+        info.socket->queue(packet);
+    }
+    else if (!visible && hidden == info.hidden_objects.end())
+    {
+        info.hidden_objects[id] = replication_tick;
+        info.shown_ticks.erase(id);
+        info.pending_member_updates.erase(id);
+        info.lod_next_update.erase(id);
+        info.lod_deferred_updates.erase(id);
+        sp::io::DataBuffer packet;
+        generateDeletePacketFor(id, packet);
+        info.socket->queue(packet);
+    }
+}
+
+void GameServer::updateVisibility()
+{
+    for(auto& client : clientList)
+    {
+        if (client.receive_state == CRS_Auth || !client.socket)
+            continue;
+        if (client.visibility_changed)
+        {
+            client.visibility_changed = false;
+            for(auto& it : objectMap)
+                if (it.second && it.second->replicated)
+                    applyVisibility(client, *it.second);
+        }else{
+            for(auto obj : visibility_changed_objects)
+                applyVisibility(client, obj);
+        }
+    }
+}
+
+void GameServer::setClientVisibilityMask(int32_t client_id, uint32_t mask)
+{
+    auto info = findClientConnection(client_id);
+    if (!info || info->client_id != client_id || info->visibility_mask == mask)
+        return;
+    info->visibility_mask = mask;
+    info->visibility_changed = true;
+}
+
+void GameServer::sendUpdate(MultiplayerObject* obj, sp::io::DataBuffer& packet)
+{
+    int32_t object_id = obj->multiplayerObjectId;
+    sendDataCounterPerClient += packet.getDataSize();
+    if (recorder)
+        recorder->writeFrame(getServerTime(), packet);
+    //Predicted objects are not held back by LOD tiers, acknowledging client commands waits for their state.
+    Collisionable* collisionable = nullptr;
+    if (replication_lod_active && !obj->client_prediction)
+        collisionable = dynamic_cast<Collisionable*>(obj);
+    glm::vec2 position = collisionable ? collisionable->getPosition() : glm::vec2{};
+    for(auto& client : clientList)
+    {
+        if (client.receive_state == CRS_Auth || !client.socket)
+            continue;
+        if (!client.hidden_objects.empty() && client.hidden_objects.find(object_id) != client.hidden_objects.end())
+            continue;
+        if (client.socket->getSendQueueSize() > client.send_queue_high_water_mark)
+        {
+            //The client is not keeping up, only keep the latest value of each member till it has caught up.
+            auto& pending = client.pending_member_updates[object_id];
+            //Values held back by a LOD tier are older than anything pending, they are only used for members without a pending value.
+            auto deferred = client.lod_deferred_updates.find(object_id);
+            if (deferred != client.lod_deferred_updates.end())
+            {
+                for(auto& member : deferred->second.members)
+                    pending.emplace(member.first, std::move(member.second));
+                client.lod_deferred_updates.erase(deferred);
+            }
+            const uint8_t* data = static_cast<const uint8_t*>(packet.getData());
+            for(const auto& member : update_member_ranges)
+            {
+                auto& value = pending[member.index];
+                if (!value.empty())
+                    client.dropped_updates++;
+                value.assign(data + member.start, data + member.end);
+                client.deferred_updates++;
+            }
+        }else{
+            sendPendingMemberUpdates(client);
+            float update_interval = (collisionable && client.has_focus_position) ? getLodUpdateInterval(client, position) : 0.0f;
+            if (update_interval > 0.0f || client.lod_deferred_updates.find(object_id) != client.lod_deferred_updates.end())
+                sendLodUpdate(client, object_id, packet, update_interval);
+            else
+                client.socket->queue(packet);
+        }
+    }
+}
+
+void GameServer::updateLodFocus()
+{
+    replication_lod_active = false;
+    replication_lod_time = getServerTime();
+    if (replication_lod_tiers.empty())
+        return;
+    for(auto& client : clientList)
+    {
+        P<Collisionable> focus = client.focus_object;
+        client.has_focus_position = bool(focus);
+        if (focus)
+        {
+            client.focus_position = focus->getPosition();
+            replication_lod_active = true;
+        }
+    }
+}
+
+float GameServer::getLodUpdateInterval(ClientInfo& info, const glm::vec2& position)
+{
+    float distance = glm::length(position - info.focus_position);
+    float update_interval = 0.0f;
+    for(auto& tier : replication_lod_tiers)
+    {
+        if (distance <= tier.distance)
+            break;
+        update_interval = tier.update_interval;
+    }
+    return update_interval;
+}
+
+void GameServer::sendLodUpdate(ClientInfo& info, int32_t object_id, sp::io::DataBuffer& packet, float update_interval)
+{
+    auto deferred = info.lod_deferred_updates.find(object_id);
+    if (update_interval > 0.0f)
+    {
+        auto next_update = info.lod_next_update.find(object_id);
+        if (next_update != info.lod_next_update.end() && replication_lod_time < next_update->second)
+        {
+            //Too soon for the tier of this object, keep the latest value of each member till the next update is due.
+            if (deferred == info.lod_deferred_updates.end())
+            {
+                deferred = info.lod_deferred_updates.emplace(object_id, LodDeferredUpdate{}).first;
+                deferred->second.first_tick = replication_tick;
+            }
+            deferred->second.send_time = next_update->second;
+            deferred->second.update_interval = update_interval;
+            const uint8_t* data = static_cast<const uint8_t*>(packet.getData());
+            for(const auto& member : update_member_ranges)
+                deferred->second.members[member.index].assign(data + member.start, data + member.end);
+            return;
+        }
+        info.lod_next_update[object_id] = replication_lod_time + update_interval;
+    }else{
+        info.lod_next_update.erase(object_id);
+    }
+    if (deferred != info.lod_deferred_updates.end())
+    {
+        //Values held back before go out together with the new ones.
+        const uint8_t* data = static_cast<const uint8_t*>(packet.getData());
+        for(const auto& member : update_member_ranges)
+            deferred->second.members[member.index].assign(data + member.start, data + member.end);
+        queueMemberUpdates(info, object_id, deferred->second.members);
+        info.lod_deferred_updates.erase(deferred);
+    }else{
+        info.socket->queue(packet);
+    }
+}
+
+void GameServer::sendDueLodUpdates(ClientInfo& info, bool all)
+{
+    for(auto it = info.lod_deferred_updates.begin(); it != info.lod_deferred_updates.end(); )
+    {
+        if (!all && it->second.send_time > replication_lod_time)
+        {
+            ++it;
+            continue;
+        }
+        queueMemberUpdates(info, it->first, it->second.members);
+        info.lod_next_update[it->first] = replication_lod_time + it->second.update_interval;
+        it = info.lod_deferred_updates.erase(it);
+    }
+}
+
+void GameServer::queueMemberUpdates(ClientInfo& info, int32_t object_id, const std::map<uint16_t, std::vector<uint8_t>>& members)
+{
+    sp::io::DataBuffer packet;
+    packet << CMD_UPDATE_VALUE << object_id;
+    for(auto& member : members)
+        packet.appendRaw(member.second.data(), member.second.size());
+    info.socket->queue(packet);
+}
+
+void GameServer::setReplicationLodTiers(std::vector<ReplicationLodTier> tiers)
+{
+    std::sort(tiers.begin(), tiers.end(), [](const ReplicationLodTier& a, const ReplicationLodTier& b) { return a.distance < b.distance; });
+    replication_lod_tiers = std::move(tiers);
+}
+
+void GameServer::setClientFocusObject(int32_t client_id, P<MultiplayerObject> obj)
+{
+    auto info = findClientConnection(client_id);
+    if (info && info->client_id == client_id)
+        info->focus_object = obj;
+}
+
+void GameServer::sendPendingCreates(ClientInfo& info)
+{
+    size_t budget = multiplayerJoinBytesPerUpdate;
+    while(info.next_pending_create < info.pending_creates.size() && budget > 0)
+    {
+        auto it = objectMap.find(info.pending_creates[info.next_pending_create++]);
+        //Objects deleted since the join are skipped, the client ignored the delete.
+        if (it == objectMap.end() || !it->second || !it->second->replicated)
+            continue;
+        if (!isObjectVisibleTo(info, *it->second))
+        {
+            info.hidden_objects.emplace(it->first, replication_tick);
+            continue;
+        }
+        sp::io::DataBuffer packet;
+        generateCreatePacketFor(it->second, packet);
+        sendDataCounter += packet.getDataSize();
+        info.socket->queue(packet);
+        budget -= std::min(budget, size_t(packet.getDataSize()));
+    }
+    if (info.next_pending_create == info.pending_creates.size())
+    {
+        info.pending_creates.clear();
+        info.next_pending_create = 0;
+    }
+}
+
+void GameServer::sendPendingMemberUpdates(ClientInfo& info)
+{
+    for(auto& it : info.pending_member_updates)
+        queueMemberUpdates(info, it.first, it.second);
+    info.pending_member_updates.clear();
+}
+
+void GameServer::setReplicationThreadCount(int count)
+{
+    replication_workers.setThreadCount(std::max(count, 0));
+}
+
+void GameServer::setSendQueueLimits(size_t high_water_mark, size_t hard_limit)
+{
+    send_queue_high_water_mark = high_water_mark;
+    send_queue_hard_limit = hard_limit;
+}
+
+void GameServer::setClientSendQueueLimits(int32_t client_id, size_t high_water_mark, size_t hard_limit)
+{
+    auto info = findClientConnection(client_id);
+    if (!info)
+        return;
+    info->send_queue_high_water_mark = high_water_mark;
+    info->send_queue_hard_limit = hard_limit;
+}
+
+bool GameServer::startRecording(string filename, float keyframe_interval)
+{
+    stopRecording();
+    recorder = std::make_unique<ReplicationRecorder>();
+    if (!recorder->open(filename))
+    {
+        recorder = nullptr;
+        return false;
+    }
+    writeRecordingKeyframe();
+    recording_keyframe_timer.repeat(keyframe_interval);
+    return true;
+}
+
+void GameServer::stopRecording()
+{
+    if (!recorder)
+        return;
+    recorder->writeTick(getServerTime());
+    recorder = nullptr;
+}
+
+bool GameServer::saveWorld(const string& filename)
+{
+    if (world_save_busy)
+    {
+        LOG(WARNING) << "World save still in progress, not saving " << filename;
+        return false;
+    }
+    finishWorldSave();
+
+    //File layout: magic, version, object count. Then per object: class name, id, member count,
+    // and per member: index, size and the data as written by its send function.
+    auto data = std::make_shared<sp::io::DataBuffer>();
+    data->appendRaw(world_save_magic, sizeof(world_save_magic));
+    uint32_t object_count = 0;
+    for(auto& it : objectMap)
+        if (it.second)
+            object_count++;
+    *data << world_save_version << object_count;
+
+    sp::io::DataBuffer member_data;
+    for(auto& it : objectMap)
+    {
+        P<MultiplayerObject> obj = it.second;
+        if (!obj)
+            continue;
+        *data << obj->multiplayerClassIdentifier << it.first << uint32_t(obj->memberReplicationInfo.size());
+        for(unsigned int n=0; n<obj->memberReplicationInfo.size(); n++)
+        {
+            auto& info = obj->memberReplicationInfo[n];
+            member_data.clear();
+            //Strings are saved inline, the ids of the string table mean nothing outside of this session.
+            if (info.sendFunction == &multiplayerReplicationFunctions<string>::sendData)
+                member_data << uint32_t(0) << *static_cast<string*>(info.ptr);
+            else
+                (info.sendFunction)(info.ptr, member_data);
+            *data << uint32_t(n) << uint32_t(member_data.getDataSize());
+            data->appendRaw(member_data.getData(), member_data.getDataSize());
+        }
+    }
+
+    world_save_filename = filename;
+    world_save_busy = true;
+    world_save_thread = std::thread([this, data, filename]()
+    {
+        //Write next to the target and rename it, so an interrupted save never replaces a good file.
+        string temp_filename = filename + ".tmp";
+        FILE* f = fopen(temp_filename.c_str(), "wb");
+        bool success = f != nullptr;
+        if (f)
+        {
+            success = fwrite(data->getData(), 1, data->getDataSize(), f) == data->getDataSize();
+            success = fclose(f) == 0 && success;
+        }
+        if (success)
+            success = sp::io::replaceFile(temp_filename, filename);
+        world_save_failed = !success;
+        world_save_busy = false;
+    });
+    return true;
+}
+
+void GameServer::finishWorldSave()
+{
+    //The save thread only leaves its result, logging is not thread safe.
+    if (!world_save_thread.joinable())
+        return;
+    world_save_thread.join();
+    if (world_save_failed)
+        LOG(ERROR) << "Failed to write world save " << world_save_filename;
+}
+
+bool GameServer::loadWorld(const string& filename)
+{
+    sp::io::MappedFile file;
+    if (!file.open(filename))
+    {
+        LOG(ERROR) << "Failed to open world save " << filename;
+        return false;
+    }
+    sp::io::DataView view(file.getData(), file.getDataSize());
+    char magic[sizeof(world_save_magic)];
+    uint32_t version = 0;
+    uint32_t object_count = 0;
+    if (!view.readRaw(magic, sizeof(magic)) || memcmp(magic, world_save_magic, sizeof(magic)) != 0)
+    {
+        LOG(ERROR) << filename << " is not a world save";
+        return false;
+    }
+    view >> version >> object_count;
+    if (version != world_save_version)
+    {
+        LOG(ERROR) << "Unsupported world save version " << version << " in " << filename;
+        return false;
+    }
+
+    sp::io::DataBuffer member_data;
+    for(uint32_t object_index=0; object_index<object_count && view.available(); object_index++)
+    {
+        string class_name;
+        int32_t id = 0;
+        uint32_t member_count = 0;
+        view >> class_name >> id >> member_count;
+
+        MultiplayerObject* obj = nullptr;
+        for(MultiplayerClassListItem* i = multiplayerClassListStart; i; i = i->next)
+        {
+            if (i->name == class_name)
+            {
+                obj = i->func();
+                break;
+            }
+        }
+        if (!obj)
+            LOG(WARNING) << "Skipping object " << id << " of unknown class " << class_name << " in world save";
+        if (obj && id != obj->multiplayerObjectId)
+        {
+            //Keep the saved id, objects can refer to each other by id.
+            auto existing = objectMap.find(id);
+            if (existing != objectMap.end() && existing->second)
+            {
+                LOG(WARNING) << "Object id " << id << " from world save already in use, loaded as " << obj->multiplayerObjectId;
+            }
+            else
+            {
+                objectMap.erase(obj->multiplayerObjectId);
+                obj->multiplayerObjectId = id;
+                objectMap[id] = obj;
+                nextObjectId = std::max(nextObjectId, id + 1);
+            }
+        }
+
+        for(uint32_t member_index=0; member_index<member_count; member_index++)
+        {
+            uint32_t index = 0;
+            uint32_t size = 0;
+            sp::io::DataView data;
+            view >> index >> size;
+            if (!view.readView(data, size))
+            {
+                LOG(ERROR) << "Truncated world save " << filename;
+                return false;
+            }
+            if (!obj || index >= obj->memberReplicationInfo.size())
+                continue;
+            auto& info = obj->memberReplicationInfo[index];
+            member_data.clear();
+            member_data.appendRaw(data.getData(), data.getDataSize());
+            (info.receiveFunction)(info.ptr, member_data);
+            if (member_data.available() > 0)
+                LOG(WARNING) << "Member " << index << " of " << class_name << " did not match the world save";
+        }
+    }
+    return true;
+}
+
+void GameServer::writeRecordingKeyframe()
+{
+    //Generate the create packets first, any string table definitions they cause are then recorded as normal frames before the keyframe.
+    std::vector<sp::io::DataBuffer> create_packets;
+    for(auto& it : objectMap)
+    {
+        P<MultiplayerObject> obj = it.second;
+        if (obj && obj->replicated)
+        {
+            create_packets.emplace_back();
+            generateCreatePacketFor(obj, create_packets.back());
+        }
+    }
+
+    double time = getServerTime();
+    recorder->beginKeyframe(time);
+    {
+        sp::io::DataBuffer packet;
+        packet << CMD_SET_GAME_SPEED << lastGameSpeed;
+        recorder->writeFrame(time, packet);
+    }
+    string_table.forEachDefinition([this, time](uint32_t id, const string& value)
+    {
+        sp::io::DataBuffer packet;
+        packet << CMD_STRING_TABLE_SET << id << value;
+        recorder->writeFrame(time, packet);
+    });
+    for(auto& packet : create_packets)
+        recorder->writeFrame(time, packet);
+    recorder->endKeyframe(time);
+}
+
+void GameServer::writeTableString(sp::io::DataBuffer& packet, const string& str)
+{
+    //Definitions go to all clients, so strings of objects that not every client can see are never put in the table.
+    if (inline_table_strings || str.length() < ReplicationStringTable::min_string_length)
+    {
+        packet << uint32_t(0) << str;
+        return;
+    }
+    uint32_t id;
+    auto result = string_table.lookup(str, id);
+    if (result != ReplicationStringTable::LookupResult::Found)
+    {
+        //Coalesced updates of slow clients and values held back by LOD tiers can still refer to the string this id had before,
+        // they have to arrive before the new definition.
+        if (result == ReplicationStringTable::LookupResult::Replaced)
+        {
+            for(auto& client : clientList)
+            {
+                if (client.receive_state == CRS_Auth || !client.socket)
+                    continue;
+                if (!client.pending_member_updates.empty())
+                    sendPendingMemberUpdates(client);
+                if (!client.lod_deferred_updates.empty())
+                    sendDueLodUpdates(client, true);
+            }
+        }
+        sp::io::DataBuffer definition;
+        definition << CMD_STRING_TABLE_SET << id << str;
+        sendAll(definition);
+    }
+    packet << uint32_t(id + 1);
+}
+
+void GameServer::sendStringTable(ClientInfo& info)
+{
+    string_table.forEachDefinition([&info](uint32_t id, const string& value)
+    {
+        sp::io::DataBuffer packet;
+        packet << CMD_STRING_TABLE_SET << id << value;
+        info.socket->queue(packet);
+    });
+}
+
 void GameServer::registerOnMasterServer(string master_url)
 {
     this->master_server_url = master_url;
@@ -660,6 +1818,16 @@ void GameServer::gotAudioPacket(int32_t client_id, const unsigned char* packet,
         audio_stream_manager.receivedPacketFromNetwork(client_id, packet, packet_size);
 }
 
+void GameServer::forwardAudioPacket(int32_t client_id, sp::io::DataBuffer& packet)
+{
+    //The received frame already is the command, client id and payload that we send out, so forward it as it is.
+    auto payload = packet.getView();
+    sendAudioPacketFrom(client_id, packet);
+
+    if (client_id != 0)
+        audio_stream_manager.receivedPacketFromNetwork(client_id, static_cast<const unsigned char*>(payload.getRemainingData()), static_cast<int>(payload.available()));
+}
+
 void GameServer::stopAudio(int32_t client_id)
 {
     sp::io::DataBuffer audio_packet;
@@ -7,16 +7,31 @@
 #include "Updatable.h"
 #include "stringImproved.h"
 #include "networkAudioStream.h"
+#include "multiplayer.h"
+#include "multiplayer_timing.h"
+#include "multiplayer_profiler.h"
+#include "multiplayer_recorder.h"
+#include "multiplayer_string_table.h"
+#include "multiplayer_worker_pool.h"
 #include "timer.h"
 
+#include <glm/vec2.hpp>
 #include <stdint.h>
 #include <unordered_map>
 #include <unordered_set>
+#include <map>
+#include <deque>
 #include <thread>
+#include <atomic>
 
 
 static const int defaultServerPort = 35666;
 static const int multiplayerVerficationNumber = 0x2fab3f0f; //Used to verify that the server is actually a serious proton server
+static constexpr float multiplayerTimeSyncInterval = 0.25f; //Interval at which both ends of a connection send timestamps for round trip time and clock offset estimation
+static constexpr size_t defaultSendQueueHighWaterMark = 512 * 1024; //Above this many queued bytes, updates to a client are coalesced instead of queued
+static constexpr size_t defaultSendQueueHardLimit = 32 * 1024 * 1024; //Above this many queued bytes, a client is disconnected
+static constexpr int multiplayerMaxAcceptsPerUpdate = 64; //New connections accepted in a single update, the rest waits in the listen backlog
+static constexpr size_t multiplayerJoinBytesPerUpdate = 128 * 1024; //Create packets queued per update for a joining client, the rest follows in the next updates
 
 class GameServer;
 class MultiplayerObject;
@@ -25,8 +40,40 @@ extern P<GameServer> game_server;
 
 class GameServer : public Updatable
 {
+public:
+    //Statistics of the connection a client is using. Proxied clients share the statistics of their proxy connection.
+    struct ClientStatistics
+    {
+        uint64_t bytes_sent = 0;
+        uint64_t bytes_received = 0;
+        uint64_t frames_sent = 0;
+        uint64_t frames_received = 0;
+        size_t send_queue_size = 0;
+        size_t peak_send_queue_size = 0;
+        float round_trip_time = 0.0f;
+        uint32_t dropped_updates = 0;     //Queued updates replaced by a newer value before they were send.
+        uint32_t deferred_updates = 0;    //Updates held back because the client could not keep up.
+        float compression_ratio = 1.0f;   //Payload size divided by the size on the wire.
+        size_t pending_creates = 0;       //Existing objects not send yet to a joining client.
+    };
+
+    //Objects further than distance from the focus object of a client are send to that client at most once every update_interval seconds.
+    struct ReplicationLodTier
+    {
+        float distance;
+        float update_interval;
+    };
+
+    enum class DisconnectReason
+    {
+        ConnectionClosed,
+        SendQueueOverflow  //The client could not keep up with the data send to it.
+    };
+private:
     sp::SystemStopwatch last_update_time;
     sp::SystemTimer keep_alive_send_timer;
+    sp::SystemTimer time_sync_send_timer;
+    double start_time;
     sp::io::network::UdpSocket broadcast_listen_socket;
     sp::io::network::TcpListener listenSocket;
     std::unique_ptr<sp::io::network::TcpSocket> new_socket;
@@ -43,34 +90,122 @@ class GameServer : public Updatable
     
     float lastGameSpeed;
     float boardcastServerDelay;
+    size_t send_queue_high_water_mark;
+    size_t send_queue_hard_limit;
+    float session_resume_time;
+    uint32_t replication_tick; //Incremented every update, creates and member updates are tagged with it for resuming clients
+    std::vector<ReplicationLodTier> replication_lod_tiers; //Sorted on distance
+    bool replication_lod_active;    //Tiers are set and at least one client has a focus object
+    double replication_lod_time;
 
     enum EClientReceiveState
     {
         CRS_Auth,
-        CRS_Main,
-        CRS_Command
+        CRS_Main
+    };
+    struct CommandSequence
+    {
+        uint32_t received = 0;
+        uint32_t acknowledged = 0;
+    };
+    //Member values held back from a client by a LOD tier, send as a single update once due.
+    struct LodDeferredUpdate
+    {
+        double send_time;
+        float update_interval;
+        uint32_t first_tick;    //Replication tick of the oldest value held back
+        std::map<uint16_t, std::vector<uint8_t>> members;
     };
     struct ClientInfo
     {
         std::unique_ptr<sp::io::network::TcpSocket> socket;
         int32_t client_id;
-        int32_t command_client_id;
         EClientReceiveState receive_state;
-        int32_t command_object_id;
         sp::SystemStopwatch round_trip_start_time;
         int32_t ping;
+        NetworkTiming timing;
+        uint32_t dropped_updates = 0;
+        uint32_t deferred_updates = 0;
+        size_t send_queue_high_water_mark;
+        size_t send_queue_hard_limit;
+        std::unordered_map<int32_t, std::map<uint16_t, std::vector<uint8_t>>> pending_member_updates; //Latest unsent member values per object, while over the high water mark
+        DisconnectReason disconnect_reason = DisconnectReason::ConnectionClosed;
         std::vector<int32_t> proxy_ids;
+        bool is_proxy = false;          //A GameServerProxy, its own client id is not reported to the game, only proxy_ids are
+        std::unordered_map<int32_t, CommandSequence> command_sequences; //Last client command received/acknowledged per client id (including proxied clients)
+        std::unordered_set<int32_t> predicted_command_objects; //Predicted objects commanded since the last acknowledgement, their full state goes out before it
+        std::vector<int32_t> pending_creates; //Objects that existed when the client joined, still to be created on the client
+        size_t next_pending_create = 0;
+        uint64_t session_token = 0;     //Secret the client uses to resume this session after a reconnect, 0 when resuming is disabled
+        uint32_t acked_tick = 0;        //Last replication tick the client confirmed to have everything of, 0 when not known yet
+        P<MultiplayerObject> focus_object;
+        bool has_focus_position = false;
+        glm::vec2 focus_position{};     //Position of the focus object at the start of the update
+        std::unordered_map<int32_t, double> lod_next_update;   //Earliest time of the next update of objects in a LOD tier
+        std::unordered_map<int32_t, LodDeferredUpdate> lod_deferred_updates;
+        uint32_t visibility_mask = multiplayerVisibleToAll;
+        bool visibility_changed = false;
+        std::unordered_map<int32_t, uint32_t> hidden_objects;  //Objects this client cannot see, with the tick they were hidden at
+        std::unordered_map<int32_t, uint32_t> shown_ticks;     //Tick at which a hidden object was created again on the client
     };
     int32_t nextclient_id;
     std::vector<ClientInfo> clientList;
+    //Disconnected client that can still reconnect and continue with the same client id.
+    struct ResumableSession
+    {
+        int32_t client_id;
+        uint64_t token;
+        uint32_t acked_tick;
+        DisconnectReason disconnect_reason;
+        sp::SystemTimer expire_timer;
+        uint32_t visibility_mask;
+        P<MultiplayerObject> focus_object;
+        std::unordered_map<int32_t, uint32_t> hidden_objects;
+        std::unordered_map<int32_t, uint32_t> shown_ticks;
+    };
+    std::vector<ResumableSession> resumable_sessions;
+    struct DeletedObject
+    {
+        uint32_t tick;
+        int32_t id;
+    };
+    std::deque<DeletedObject> deleted_objects; //Deletes after deleted_objects_start_tick, for resuming clients
+    uint32_t deleted_objects_start_tick;
+    struct MemberUpdateRange
+    {
+        uint16_t index;
+        unsigned int start;
+        unsigned int end;
+    };
+    std::vector<MemberUpdateRange> update_member_ranges;
+    //Result of the change detection and serialization of a single object, built on the replication worker threads.
+    struct ObjectUpdate
+    {
+        bool done;
+        sp::io::DataBuffer packet;
+        std::vector<MemberUpdateRange> member_ranges;
+    };
+    std::vector<MultiplayerObject*> replication_objects;
+    std::vector<MultiplayerObject*> visibility_changed_objects;
+    std::vector<ObjectUpdate> object_updates;
+    ReplicationWorkerPool replication_workers;
     std::unordered_map<int32_t, std::unordered_set<int32_t>> voice_targets;
     NetworkAudioStreamManager audio_stream_manager;
 
     int32_t nextObjectId;
     std::unordered_map<int32_t, P<MultiplayerObject> > objectMap;
+    ReplicationProfiler replication_profiler;
+    std::unique_ptr<ReplicationRecorder> recorder;
+    ReplicationStringTable string_table;
+    bool inline_table_strings = false;  //Set while serializing an object with restricted visibility
+    sp::SystemTimer recording_keyframe_timer;
 
     string master_server_url;
     std::thread master_server_update_thread;
+    std::thread world_save_thread;
+    std::atomic<bool> world_save_busy{false};
+    std::atomic<bool> world_save_failed{false};  //Result of the save thread, reported from update()
+    string world_save_filename;
 public:
     GameServer(string server_name, int versionNumber, int listenPort = defaultServerPort);
     virtual ~GameServer();
@@ -85,6 +220,67 @@ public:
     inline float getSendDataRatePerClient() { return sendDataRatePerClient; }
     inline float getUpdateTime() { return update_run_time; }
 
+    double getServerTime() { return NetworkTiming::now() - start_time; } //Seconds since the server was started, clients estimate this with GameClient::getServerTime
+    //Connection timing of a client, for proxied clients this is the timing of the connection to the proxy.
+    float getClientRoundTripTime(int32_t client_id);
+    float getClientJitter(int32_t client_id);
+    double getClientClockOffset(int32_t client_id); //Client clock minus server clock, in seconds
+    std::vector<int32_t> getClientIds(); //All authenticated clients, including proxied clients
+    ClientStatistics getClientStatistics(int32_t client_id);
+
+    //Limits on the amount of queued data for new clients. Above the high water mark member updates are coalesced
+    // so only the latest value of each member is send once the client catches up, above the hard limit the client is disconnected.
+    void setSendQueueLimits(size_t high_water_mark, size_t hard_limit);
+    void setClientSendQueueLimits(int32_t client_id, size_t high_water_mark, size_t hard_limit);
+
+    //Keep the session of a disconnected client for this many seconds. A GameClient that reconnects within that time keeps its client id
+    // and only receives the objects and members that changed since the last tick it acknowledged, instead of the full world.
+    // onClientDisconnected is called once the session expires without a reconnect. 0 (the default) disables resuming.
+    void setSessionResumeTime(float seconds) { session_resume_time = seconds; }
+    float getSessionResumeTime() { return session_resume_time; }
+
+    //Lower the update rate of far away objects per client, on top of the significance check of Collisionable replication.
+    // Distances are between Collisionables, from the focus object of the client, usually the object the player controls.
+    // Objects that are not Collisionable, predicted objects and clients without a focus object always get every update.
+    void setReplicationLodTiers(std::vector<ReplicationLodTier> tiers);
+    //The focus object of a directly connected client, proxied clients share the rates of their proxy connection and cannot have one.
+    void setClientFocusObject(int32_t client_id, P<MultiplayerObject> obj);
+
+    //Objects are only replicated to clients whose mask shares a bit with the visibility mask of the object, for example one bit per team.
+    // Like the focus object, only for directly connected clients, a proxy connection sees everything.
+    // Visibility is per connection: an object listed for one proxied client (see MultiplayerObject::setReplicationVisibleClients)
+    // goes to its whole proxy, and the proxy passes it on to all its clients. Only hide information from players that connect directly.
+    // Set it in onNewClient, so the client does not get objects created that it cannot see.
+    void setClientVisibilityMask(int32_t client_id, uint32_t mask);
+
+    //Per class and member accounting of the replicated data, disabled by default.
+    ReplicationProfiler& getReplicationProfiler() { return replication_profiler; }
+
+    //Run the change detection and serialization of objects on this many extra threads. 0 (the default) keeps it all on the main thread.
+    // Objects with string or collisionable members are always handled on the main thread. The send order does not depend on the thread count.
+    void setReplicationThreadCount(int count);
+    int getReplicationThreadCount() { return replication_workers.getThreadCount(); }
+
+    //Record everything that is replicated to all clients, with a full world keyframe every keyframe_interval seconds. Play back with GameClient.
+    bool startRecording(string filename, float keyframe_interval = 10.0f);
+    void stopRecording();
+    bool isRecording() { return recorder != nullptr; }
+
+    //Binary save of all replicated objects, written with the replication functions of their members.
+    // The objects are serialized during the call, the file is written on a background thread so an autosave does not stall the server.
+    // Returns false when the previous save is still being written.
+    bool saveWorld(const string& filename);
+    bool isSavingWorld() { return world_save_busy; }
+    //Create all objects from a world save with their saved ids, on a server without those objects.
+    // Members are matched on class name and member index, objects of unknown classes and unknown members are skipped.
+    bool loadWorld(const string& filename);
+
+    //Strings written with writeTableString (or the global writeTableString) are send in full once, after that as a small id.
+    // Members of objects with restricted visibility are always send in full. The payload of server commands of such objects has
+    // to be written with MultiplayerObject::writeTableString, which does the same, the definition of a new string goes to every client.
+    ReplicationStringTable& getStringTable() { return string_table; }
+    void writeTableString(sp::io::DataBuffer& packet, const string& str);
+
     string getServerName() { return server_name; }
     void setServerName(string name) { server_name = name; }
     
@@ -100,13 +296,44 @@ private:
     void registerObject(P<MultiplayerObject> obj);
     void broadcastServerCommandFromObject(int32_t id, sp::io::DataBuffer& packet);
     void keepAliveAll();
+    void sendTimeSyncAll();
+    void handleTimeSync(ClientInfo& info, uint16_t command, sp::io::DataBuffer& packet);
+    ClientInfo* findClientConnection(int32_t client_id);
+    void acknowledgeClientCommands();
     void sendAll(sp::io::DataBuffer& packet);
+    void sendObjectPacket(int32_t object_id, sp::io::DataBuffer& packet); //To all clients that can see the object
+    static bool isVisibilityRestricted(MultiplayerObject* obj);
+    static bool isObjectVisibleTo(const ClientInfo& info, MultiplayerObject* obj);
+    bool isObjectVisibleToAnyClient(MultiplayerObject* obj);
+    void applyVisibility(ClientInfo& info, MultiplayerObject* obj);
+    void updateVisibility();
+    void sendUpdate(MultiplayerObject* obj, sp::io::DataBuffer& packet);
+    float getLodUpdateInterval(ClientInfo& info, const glm::vec2& position);
+    void sendLodUpdate(ClientInfo& info, int32_t object_id, sp::io::DataBuffer& packet, float update_interval);
+    void sendDueLodUpdates(ClientInfo& info, bool all = false); //With all, also the ones that are not due yet
+    void updateLodFocus();
+    void finishWorldSave(); //Join a finished save thread and log its result
+    void sendPendingMemberUpdates(ClientInfo& info);
+    void queueMemberUpdates(ClientInfo& info, int32_t object_id, const std::map<uint16_t, std::vector<uint8_t>>& members);
+    void sendPendingCreates(ClientInfo& info);
+    void initClientInfo(ClientInfo& info);
+    void disconnectClient(ClientInfo& info);
+    bool resumeSession(ClientInfo& info, int32_t client_id, uint64_t token, uint32_t acked_tick);
+    void expireSessions();
+    void pruneDeletedObjects();
+    void writeRecordingKeyframe();
+    void sendStringTable(ClientInfo& info);
 
     void generateCreatePacketFor(P<MultiplayerObject> obj, sp::io::DataBuffer& packet);
+    static bool buildUpdatePacket(MultiplayerObject* obj, float delta, sp::io::DataBuffer& packet, std::vector<MemberUpdateRange>& member_ranges);
     void generateDeletePacketFor(int32_t id, sp::io::DataBuffer& packet);
+    static void writeMember(MultiplayerObject* obj, unsigned int index, sp::io::DataBuffer& packet); //Index, size and data, see multiplayer_internal.h
     
     void handleNewClient(ClientInfo& info);
-    void handleNewProxy(ClientInfo& info, int32_t temp_id);
+    void handleResumedClient(ClientInfo& info, uint32_t acked_tick, const std::unordered_map<int32_t, uint32_t>& hidden_objects);
+    void handleNewProxy(ClientInfo& info, int32_t temp_id, bool world_cached, bool relay);
+    void handleClientCommands(ClientInfo& info, int32_t client_id, sp::io::DataBuffer& packet);
+    void forwardAudioPacket(int32_t client_id, sp::io::DataBuffer& packet);
     
     void runMasterServerUpdateThread();
     
@@ -114,8 +341,11 @@ private:
 
     friend class MultiplayerObject;
 public:
+    //Called for every player, including the clients behind a proxy, but not for the proxy connections themselves.
     virtual void onNewClient(int32_t client_id) {}
     virtual void onDisconnectClient(int32_t client_id) {}
+    //Called with the reason of the disconnect, by default passes on to onDisconnectClient.
+    virtual void onClientDisconnected(int32_t client_id, DisconnectReason reason) { onDisconnectClient(client_id); }
     virtual std::unordered_set<int32_t> onVoiceChat(int32_t client_id, int32_t target_identifier);
 };
 
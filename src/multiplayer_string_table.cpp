@@ -0,0 +1,119 @@
+#include "multiplayer_string_table.h"
+#include "multiplayer_server.h"
+#include "multiplayer_client.h"
+#include "logging.h"
+
+#include <algorithm>
+
+
+static size_t vlqSize(uint64_t value)
+{
+    size_t size = 1;
+    while(value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+ReplicationStringTable::ReplicationStringTable()
+: max_size(default_table_size)
+{
+}
+
+void ReplicationStringTable::setMaxSize(uint32_t max_size)
+{
+    this->max_size = std::min(std::max(max_size, min_table_size), max_table_size);
+    clear();
+}
+
+void ReplicationStringTable::clear()
+{
+    entries.clear();
+    index.clear();
+    lru.clear();
+}
+
+ReplicationStringTable::LookupResult ReplicationStringTable::lookup(const string& str, uint32_t& id)
+{
+    auto it = index.find(str);
+    if (it != index.end())
+    {
+        id = it->second;
+        lru.splice(lru.end(), lru, entries[id].lru_position);
+        statistics.hits++;
+        statistics.bytes_saved += vlqSize(str.length()) + str.length() + 1 - vlqSize(id + 1);
+        return LookupResult::Found;
+    }
+
+    LookupResult result = LookupResult::Added;
+    if (entries.size() < max_size)
+    {
+        id = static_cast<uint32_t>(entries.size());
+        entries.emplace_back();
+    }else{
+        id = lru.front();
+        lru.pop_front();
+        index.erase(entries[id].value);
+        statistics.evictions++;
+        result = LookupResult::Replaced;
+    }
+    Entry& entry = entries[id];
+    entry.value = str;
+    entry.used = true;
+    entry.lru_position = lru.insert(lru.end(), id);
+    index[str] = id;
+    statistics.definitions++;
+    return result;
+}
+
+void ReplicationStringTable::define(uint32_t id, const string& value)
+{
+    if (id >= max_table_size)
+    {
+        LOG(WARNING) << "String table definition outside of the table: " << id;
+        return;
+    }
+    if (id >= entries.size())
+        entries.resize(id + 1);
+    entries[id].value = value;
+    entries[id].used = true;
+}
+
+string ReplicationStringTable::read(sp::io::DataBuffer& packet) const
+{
+    uint32_t ref = 0;
+    packet >> ref;
+    if (ref == 0)
+    {
+        string result;
+        packet >> result;
+        return result;
+    }
+    if (ref > entries.size() || !entries[ref - 1].used)
+    {
+        LOG(WARNING) << "Unknown string table id: " << (ref - 1);
+        return "";
+    }
+    return entries[ref - 1].value;
+}
+
+void writeTableString(sp::io::DataBuffer& packet, const string& str)
+{
+    if (game_server)
+        game_server->writeTableString(packet, str);
+    else
+        packet << uint32_t(0) << str;
+}
+
+string readTableString(sp::io::DataBuffer& packet)
+{
+    if (game_client)
+        return game_client->getStringTable().read(packet);
+    //On the host, broadcastServerCommand also handles the command locally, with the ids of the server table.
+    if (game_server)
+        return game_server->getStringTable().read(packet);
+    static const ReplicationStringTable empty_table;
+    return empty_table.read(packet);
+}
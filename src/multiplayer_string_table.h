@@ -0,0 +1,79 @@
+#ifndef MULTIPLAYER_STRING_TABLE_H
+#define MULTIPLAYER_STRING_TABLE_H
+
+#include "io/dataBuffer.h"
+#include "stringImproved.h"
+#include <stdint.h>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+//Table of strings that are send often, like class identifiers, callsigns and labels.
+// The server adds a string on first use and sends its definition to all clients with CMD_STRING_TABLE_SET,
+// after that only the id is send. The table has a fixed size, when it is full the least recently used string is replaced.
+// On the wire a table string is a VLQ with 0 followed by the string itself for inline strings, or the id + 1.
+class ReplicationStringTable
+{
+public:
+    static constexpr uint32_t default_table_size = 1024;
+    static constexpr uint32_t min_table_size = 64; //A single packet should never use enough strings to evict one of its own.
+    static constexpr uint32_t max_table_size = 0x10000;
+    static constexpr size_t min_string_length = 4; //Shorter strings are always send inline, an id would not save anything.
+
+    struct Statistics
+    {
+        uint64_t hits = 0;
+        uint64_t definitions = 0;
+        uint64_t evictions = 0;
+        uint64_t bytes_saved = 0; //Estimate of the bytes not send because of the table, excluding the cost of the definitions.
+    };
+
+    enum class LookupResult
+    {
+        Found,
+        Added,      //New string, the definition still needs to be send.
+        Replaced    //New string in place of an evicted one, the definition still needs to be send.
+    };
+
+    ReplicationStringTable();
+
+    void setMaxSize(uint32_t max_size); //Clears the table
+    uint32_t getMaxSize() const { return max_size; }
+    void clear();
+
+    //Server side: find or add the string.
+    LookupResult lookup(const string& str, uint32_t& id);
+    //Server side: all current definitions, for new clients and recording keyframes.
+    template<typename F> void forEachDefinition(F func) const
+    {
+        for(uint32_t id=0; id<entries.size(); id++)
+            if (entries[id].used)
+                func(id, entries[id].value);
+    }
+
+    //Client side
+    void define(uint32_t id, const string& value);
+    string read(sp::io::DataBuffer& packet) const;
+
+    const Statistics& getStatistics() const { return statistics; }
+private:
+    struct Entry
+    {
+        string value;
+        bool used = false;
+        std::list<uint32_t>::iterator lru_position;
+    };
+    uint32_t max_size;
+    std::vector<Entry> entries;
+    std::unordered_map<string, uint32_t> index;
+    std::list<uint32_t> lru; //Least recently used first
+    Statistics statistics;
+};
+
+//Write a string through the string table of the running GameServer, and read it back on the GameClient.
+// Use these for strings in server commands that are send often. Without a server, strings are written inline.
+// On the server, readTableString resolves ids through the table of the server, for commands handled on the host itself.
+void writeTableString(sp::io::DataBuffer& packet, const string& str);
+string readTableString(sp::io::DataBuffer& packet);
+
+#endif//MULTIPLAYER_STRING_TABLE_H
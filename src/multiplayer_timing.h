@@ -0,0 +1,50 @@
+#ifndef MULTIPLAYER_TIMING_H
+#define MULTIPLAYER_TIMING_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdint.h>
+
+//Round trip time, jitter and clock offset estimation for a single multiplayer connection.
+// One side sends its local time, the other side echoes it back together with its own local time.
+// Round trip time and jitter are smoothed the same way TCP does for its retransmission timer (RFC 6298).
+class NetworkTiming
+{
+public:
+    //Local clock used for network timestamps, in seconds. Only differences between two values of this clock mean anything.
+    static double now()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void addSample(double local_send_time, double remote_time, double local_receive_time)
+    {
+        float rtt = std::max(0.0, local_receive_time - local_send_time);
+        //Assume the remote time was taken halfway the round trip.
+        double offset = remote_time - (local_send_time + local_receive_time) * 0.5;
+        if (sample_count == 0)
+        {
+            round_trip_time = rtt;
+            jitter = rtt * 0.5f;
+            clock_offset = offset;
+        }else{
+            jitter = jitter * 0.75f + std::abs(round_trip_time - rtt) * 0.25f;
+            round_trip_time = round_trip_time * 0.875f + rtt * 0.125f;
+            clock_offset = clock_offset * 0.875 + offset * 0.125;
+        }
+        sample_count++;
+    }
+
+    bool hasSamples() const { return sample_count > 0; }
+    float getRoundTripTime() const { return round_trip_time; } //Smoothed round trip time in seconds.
+    float getJitter() const { return jitter; } //Mean deviation of the round trip time in seconds.
+    double getClockOffset() const { return clock_offset; } //Remote clock minus local clock, in seconds.
+private:
+    uint32_t sample_count = 0;
+    float round_trip_time = 0.0f;
+    float jitter = 0.0f;
+    double clock_offset = 0.0;
+};
+
+#endif//MULTIPLAYER_TIMING_H
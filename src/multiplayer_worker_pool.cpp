@@ -0,0 +1,83 @@
+#include "multiplayer_worker_pool.h"
+
+
+ReplicationWorkerPool::ReplicationWorkerPool()
+: job(nullptr), job_count(0), next_job(0), busy_workers(0), generation(0), stopping(false)
+{
+}
+
+ReplicationWorkerPool::~ReplicationWorkerPool()
+{
+    stop();
+}
+
+void ReplicationWorkerPool::setThreadCount(int count)
+{
+    stop();
+    stopping = false;
+    for(int n=0; n<count; n++)
+        threads.emplace_back(&ReplicationWorkerPool::workerMain, this, generation);
+}
+
+void ReplicationWorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_condition.notify_all();
+    for(auto& thread : threads)
+        thread.join();
+    threads.clear();
+}
+
+void ReplicationWorkerPool::run(size_t job_count, const std::function<void(size_t)>& func)
+{
+    if (threads.empty() || job_count < 2)
+    {
+        for(size_t n=0; n<job_count; n++)
+            func(n);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &func;
+        this->job_count = job_count;
+        next_job = 0;
+        busy_workers = threads.size();
+        generation++;
+    }
+    start_condition.notify_all();
+    runJobs();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_condition.wait(lock, [this]() { return busy_workers == 0; });
+    job = nullptr;
+}
+
+void ReplicationWorkerPool::workerMain(uint64_t seen_generation)
+{
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_condition.wait(lock, [this, seen_generation]() { return stopping || generation != seen_generation; });
+            if (stopping)
+                return;
+            seen_generation = generation;
+        }
+        runJobs();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy_workers--;
+            if (busy_workers == 0)
+                done_condition.notify_one();
+        }
+    }
+}
+
+void ReplicationWorkerPool::runJobs()
+{
+    for(size_t n = next_job++; n < job_count; n = next_job++)
+        (*job)(n);
+}
@@ -0,0 +1,42 @@
+#ifndef MULTIPLAYER_WORKER_POOL_H
+#define MULTIPLAYER_WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <stdint.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Fixed set of worker threads that run batches of independent jobs, used by the GameServer to spread replication over multiple cores.
+// The calling thread takes part in running the jobs, so with zero threads everything simply runs on the caller.
+class ReplicationWorkerPool
+{
+public:
+    ReplicationWorkerPool();
+    ~ReplicationWorkerPool();
+
+    void setThreadCount(int count);
+    int getThreadCount() const { return static_cast<int>(threads.size()); }
+
+    //Run func(0) to func(job_count - 1) spread over the workers, returns when all jobs are done.
+    void run(size_t job_count, const std::function<void(size_t)>& func);
+private:
+    void stop();
+    void workerMain(uint64_t seen_generation);
+    void runJobs();
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_condition;
+    std::condition_variable done_condition;
+    const std::function<void(size_t)>* job;
+    size_t job_count;
+    std::atomic<size_t> next_job;
+    size_t busy_workers;
+    uint64_t generation;
+    bool stopping;
+};
+
+#endif//MULTIPLAYER_WORKER_POOL_H
@@ -0,0 +1,134 @@
+#include "multiplayer_world_cache.h"
+#include "multiplayer_internal.h"
+#include "logging.h"
+
+
+ReplicationWorldCache::ReplicationWorldCache()
+: valid(true), game_speed(1.0f)
+{
+}
+
+void ReplicationWorldCache::clear()
+{
+    objects.clear();
+    string_table.clear();
+    valid = true;
+}
+
+void ReplicationWorldCache::receive(uint16_t command, sp::io::DataBuffer& packet)
+{
+    if (!valid)
+        return;
+    switch(command)
+    {
+    case CMD_CREATE:
+        {
+            int32_t id = 0;
+            packet >> id;
+            string class_name = string_table.read(packet);
+            CachedObject& object = objects[id];
+            object.class_name = class_name;
+            object.members.clear();
+            receiveMembers(object, packet);
+        }
+        break;
+    case CMD_UPDATE_VALUE:
+        {
+            int32_t id = 0;
+            packet >> id;
+            auto it = objects.find(id);
+            if (it != objects.end())
+                receiveMembers(it->second, packet);
+        }
+        break;
+    case CMD_DELETE:
+        {
+            int32_t id = 0;
+            packet >> id;
+            objects.erase(id);
+        }
+        break;
+    case CMD_SET_GAME_SPEED:
+        packet >> game_speed;
+        break;
+    case CMD_STRING_TABLE_SET:
+        {
+            uint32_t id = 0;
+            string value;
+            packet >> id >> value;
+            string_table.define(id, value);
+        }
+        break;
+    }
+}
+
+void ReplicationWorldCache::queueSnapshot(sp::io::network::TcpSocket& socket) const
+{
+    {
+        sp::io::DataBuffer packet;
+        packet << CMD_SET_GAME_SPEED << game_speed;
+        socket.queue(packet);
+    }
+    string_table.forEachDefinition([&socket](uint32_t id, const string& value)
+    {
+        sp::io::DataBuffer packet;
+        packet << CMD_STRING_TABLE_SET << id << value;
+        socket.queue(packet);
+    });
+    sp::io::DataBuffer packet;
+    for(const auto& it : objects)
+    {
+        //Class names and string members are written inline, so the snapshot does not depend on the string table.
+        packet.clear();
+        packet << CMD_CREATE << it.first << uint32_t(0) << it.second.class_name;
+        for(unsigned int n=0; n<it.second.members.size(); n++)
+        {
+            const CachedMember& member = it.second.members[n];
+            if (member.data.empty())
+                continue;
+            packet << int16_t(n) << (uint32_t(member.data.size()) << 1 | (member.table_string ? 1 : 0));
+            packet.appendRaw(member.data.data(), member.data.size());
+        }
+        socket.queue(packet);
+    }
+}
+
+bool ReplicationWorldCache::receiveMembers(CachedObject& object, sp::io::DataBuffer& packet)
+{
+    while(packet.available())
+    {
+        int16_t idx = -1;
+        uint32_t size = 0;
+        packet >> idx >> size;
+        sp::io::DataView data;
+        if (idx < 0 || !packet.readView(data, size >> 1))
+        {
+            invalidate("broken member " + string(idx) + " of " + object.class_name);
+            return false;
+        }
+        if (size_t(idx) >= object.members.size())
+            object.members.resize(idx + 1);
+        CachedMember& member = object.members[idx];
+        member.table_string = (size & 1) != 0;
+        if (member.table_string)
+        {
+            //Table strings are stored inline, the id could be redefined before a new client needs the value.
+            sp::io::DataBuffer value;
+            value.appendRaw(data.getRemainingData(), data.available());
+            string str = string_table.read(value);
+            value.clear();
+            value << uint32_t(0) << str;
+            member.data.assign(static_cast<const char*>(value.getData()), value.getDataSize());
+        }else{
+            member.data.assign(static_cast<const char*>(data.getRemainingData()), data.available());
+        }
+    }
+    return true;
+}
+
+void ReplicationWorldCache::invalidate(const string& reason)
+{
+    LOG(WARNING) << "Proxy world cache disabled, " << reason << ". New clients get the world from the server.";
+    objects.clear();
+    valid = false;
+}
@@ -0,0 +1,51 @@
+#ifndef MULTIPLAYER_WORLD_CACHE_H
+#define MULTIPLAYER_WORLD_CACHE_H
+
+#include "stringImproved.h"
+#include "multiplayer_string_table.h"
+#include "io/network/tcpSocket.h"
+#include <map>
+#include <vector>
+
+//Mirror of the replicated world, kept by a GameServerProxy from the stream it forwards.
+// Holds the class of each object and the latest encoded value of each member, so the proxy can send
+// new clients a full snapshot by itself instead of the server sending the whole world over the shared upstream link.
+// Members are stored as the opaque data the server wrote, split by their sizes, so the proxy never creates game objects.
+class ReplicationWorldCache
+{
+public:
+    ReplicationWorldCache();
+
+    void clear();
+
+    //Update the mirror from a packet received from the server, after the command has been read.
+    void receive(uint16_t command, sp::io::DataBuffer& packet);
+
+    //False when something in the stream could not be decoded, new clients then need the world from the server.
+    bool isValid() const { return valid; }
+    size_t getObjectCount() const { return objects.size(); }
+
+    //Queue game speed, string table definitions and all objects, as the server would for a new client.
+    void queueSnapshot(sp::io::network::TcpSocket& socket) const;
+private:
+    struct CachedMember
+    {
+        std::string data;           //Encoded value, empty when not received yet
+        bool table_string = false;  //Written with writeTableString, stored with the string inline
+    };
+    struct CachedObject
+    {
+        string class_name;
+        std::vector<CachedMember> members; //By member index
+    };
+
+    bool receiveMembers(CachedObject& object, sp::io::DataBuffer& packet);
+    void invalidate(const string& reason);
+
+    bool valid;
+    float game_speed;
+    ReplicationStringTable string_table;
+    std::map<int32_t, CachedObject> objects; //Ordered by id, so the snapshot creates objects in the order the server did
+};
+
+#endif//MULTIPLAYER_WORLD_CACHE_H
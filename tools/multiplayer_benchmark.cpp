@@ -0,0 +1,234 @@
+//Micro-benchmark of the multiplayer replication path, without any network traffic.
+//Builds a synthetic world, runs the change detection and serialization of GameServer::update,
+//and then applies the recorded stream on a GameClient. Reports time per object, bytes per tick and heap allocations per tick.
+//
+//Usage: multiplayer_benchmark [--objects 1000] [--members 8] [--types float,int32,double,string]
+//                             [--change-ratio 0.25] [--ticks 600]
+#include "engine.h"
+#include "random.h"
+#include "multiplayer.h"
+#include "multiplayer_server.h"
+#include "multiplayer_client.h"
+#include "multiplayer_recorder.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+
+//Count every heap allocation, so changes that add allocations to the hot path show up.
+static std::atomic<uint64_t> allocation_count{0};
+
+void* operator new(size_t size)
+{
+    allocation_count++;
+    if (void* ptr = malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+enum class MemberType
+{
+    Float,
+    Int32,
+    Double,
+    String
+};
+
+struct BenchmarkSettings
+{
+    int object_count = 1000;
+    int member_count = 8;
+    std::vector<MemberType> member_types{MemberType::Float, MemberType::Int32, MemberType::Double, MemberType::String};
+    float change_ratio = 0.25f; //Chance for each member to change on a tick
+    int tick_count = 600;
+};
+static BenchmarkSettings settings;
+
+//Object with settings.member_count members, cycling through settings.member_types.
+class BenchmarkObject : public MultiplayerObject
+{
+public:
+    std::vector<float> floats;
+    std::vector<int32_t> ints;
+    std::vector<double> doubles;
+    std::vector<string> strings;
+
+    BenchmarkObject()
+    : MultiplayerObject("BenchmarkObject")
+    {
+        //Reserve up front, the replication keeps pointers into these vectors.
+        floats.reserve(settings.member_count);
+        ints.reserve(settings.member_count);
+        doubles.reserve(settings.member_count);
+        strings.reserve(settings.member_count);
+        for(int n=0; n<settings.member_count; n++)
+        {
+            switch(settings.member_types[n % settings.member_types.size()])
+            {
+            case MemberType::Float:
+                floats.push_back(0.0f);
+                registerMemberReplication(&floats.back());
+                break;
+            case MemberType::Int32:
+                ints.push_back(0);
+                registerMemberReplication(&ints.back());
+                break;
+            case MemberType::Double:
+                doubles.push_back(0.0);
+                registerMemberReplication(&doubles.back());
+                break;
+            case MemberType::String:
+                strings.push_back("");
+                registerMemberReplication(&strings.back());
+                break;
+            }
+        }
+    }
+
+    void change(int tick)
+    {
+        for(auto& f : floats)
+            if (random(0.0f, 1.0f) < settings.change_ratio)
+                f += 1.0f;
+        for(auto& i : ints)
+            if (random(0.0f, 1.0f) < settings.change_ratio)
+                i += 1;
+        for(auto& d : doubles)
+            if (random(0.0f, 1.0f) < settings.change_ratio)
+                d += 1.0;
+        for(auto& s : strings)
+            if (random(0.0f, 1.0f) < settings.change_ratio)
+                s = "value " + string(tick);
+    }
+};
+REGISTER_MULTIPLAYER_CLASS(BenchmarkObject, "BenchmarkObject");
+
+static bool parseArguments(int argc, char** argv)
+{
+    for(int n=1; n<argc; n++)
+    {
+        string arg = argv[n];
+        if (n + 1 >= argc)
+            return false;
+        string value = argv[++n];
+        if (arg == "--objects")
+            settings.object_count = value.toInt();
+        else if (arg == "--members")
+            settings.member_count = value.toInt();
+        else if (arg == "--change-ratio")
+            settings.change_ratio = value.toFloat();
+        else if (arg == "--ticks")
+            settings.tick_count = value.toInt();
+        else if (arg == "--types")
+        {
+            settings.member_types.clear();
+            for(auto& type : value.lower().split(","))
+            {
+                if (type == "float")
+                    settings.member_types.push_back(MemberType::Float);
+                else if (type == "int32")
+                    settings.member_types.push_back(MemberType::Int32);
+                else if (type == "double")
+                    settings.member_types.push_back(MemberType::Double);
+                else if (type == "string")
+                    settings.member_types.push_back(MemberType::String);
+                else
+                    return false;
+            }
+        }
+        else
+            return false;
+    }
+    return settings.object_count > 0 && settings.member_count > 0 && settings.tick_count > 0 && !settings.member_types.empty();
+}
+
+int main(int argc, char** argv)
+{
+    if (!parseArguments(argc, argv))
+    {
+        fprintf(stderr, "Usage: %s [--objects 1000] [--members 8] [--types float,int32,double,string] [--change-ratio 0.25] [--ticks 600]\n", argv[0]);
+        return 1;
+    }
+    const string recording_filename = "multiplayer_benchmark.sprr";
+    const double object_ticks = double(settings.object_count) * settings.tick_count;
+
+    new Engine();
+
+    //Server side: without any clients connected, GameServer::update only does the change detection and serialization.
+    P<GameServer> server = new GameServer("Benchmark", 0, 0);
+    PVector<BenchmarkObject> objects;
+    for(int n=0; n<settings.object_count; n++)
+        objects.push_back(new BenchmarkObject());
+    server->update(0.0f); //Initial replication of all objects.
+
+    uint64_t server_allocations = 0;
+    double server_time = 0.0;
+    for(int tick=0; tick<settings.tick_count; tick++)
+    {
+        foreach(BenchmarkObject, obj, objects)
+            obj->change(tick);
+        uint64_t allocations = allocation_count;
+        server->update(0.0f);
+        server_allocations += allocation_count - allocations;
+        server_time += server->getUpdateTime();
+    }
+
+    //Second pass with the profiler and recorder enabled, for the byte counts and the stream to apply on the client.
+    server->getReplicationProfiler().setEnabled(true);
+    server->getReplicationProfiler().reset();
+    if (!server->startRecording(recording_filename, 1.0e9f))
+    {
+        fprintf(stderr, "Failed to open %s\n", recording_filename.c_str());
+        return 1;
+    }
+    for(int tick=0; tick<settings.tick_count; tick++)
+    {
+        foreach(BenchmarkObject, obj, objects)
+            obj->change(tick);
+        server->update(0.0f);
+    }
+    uint64_t total_bytes = server->getReplicationProfiler().getTotalBytes();
+    server->stopRecording();
+    foreach(BenchmarkObject, obj, objects)
+        obj->destroy();
+    server->destroy();
+
+    //Client side: create the world from the initial keyframe with the playback paused, then apply all recorded ticks in a single update.
+    auto playback = std::make_unique<ReplicationPlayback>();
+    if (!playback->open(recording_filename))
+    {
+        fprintf(stderr, "Failed to read back %s\n", recording_filename.c_str());
+        return 1;
+    }
+    playback->setSpeed(0.0f);
+    P<GameClient> client = new GameClient(std::move(playback));
+    client->update(0.0f);
+    client->getPlayback()->setSpeed(1.0e9f);
+    uint64_t allocations = allocation_count;
+    sp::SystemStopwatch client_clock;
+    client->update(0.0f);
+    double client_time = client_clock.get();
+    uint64_t client_allocations = allocation_count - allocations;
+    client->destroy();
+    remove(recording_filename.c_str());
+
+    printf("objects: %d, members: %d, change ratio: %.2f, ticks: %d\n", settings.object_count, settings.member_count, settings.change_ratio, settings.tick_count);
+    printf("server: %10.1f ns/object %12.1f bytes/tick %10.1f allocations/tick\n",
+        server_time / object_ticks * 1.0e9, double(total_bytes) / settings.tick_count, double(server_allocations) / settings.tick_count);
+    printf("client: %10.1f ns/object %12s            %10.1f allocations/tick\n",
+        client_time / object_ticks * 1.0e9, "", double(client_allocations) / settings.tick_count);
+    return 0;
+}
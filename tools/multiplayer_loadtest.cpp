@@ -0,0 +1,386 @@
+//Headless load generator for the multiplayer server.
+//Runs a GameServer with a synthetic world in-process, and opens a growing number of raw protocol connections to it.
+//For each client count it reports the server tick time, the bytes received per client, the server side send queue depth
+//and the latency of time sync round trips and client command acknowledgements.
+//
+//Usage: multiplayer_loadtest [--clients 1,10,50,100] [--objects 500] [--duration 10] [--port 35700]
+//                            [--command-rate 0] [--command-size 16] [--tick-rate 60]
+#include "engine.h"
+#include "random.h"
+#include "multiplayer.h"
+#include "multiplayer_server.h"
+#include "multiplayer_internal.h"
+#include "multiplayer_timing.h"
+#include "io/network/tcpSocket.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+static constexpr int loadtest_version = 1;
+
+//Replicated object with a few members that change every tick, client commands nudge its velocity.
+class LoadTestObject : public MultiplayerObject, public Updatable
+{
+public:
+    float x = 0.0f;
+    float y = 0.0f;
+    float rotation = 0.0f;
+    float velocity_x = 0.0f;
+    float velocity_y = 0.0f;
+    int32_t command_count = 0;
+
+    LoadTestObject()
+    : MultiplayerObject("LoadTestObject")
+    {
+        registerMemberReplication(&x, 0.1f);
+        registerMemberReplication(&y, 0.1f);
+        registerMemberReplication(&rotation, 0.2f);
+        registerMemberReplication(&command_count);
+        velocity_x = random(-100.0f, 100.0f);
+        velocity_y = random(-100.0f, 100.0f);
+    }
+
+    virtual void update(float delta) override
+    {
+        x += velocity_x * delta;
+        y += velocity_y * delta;
+        rotation += 45.0f * delta;
+        if (rotation > 360.0f)
+            rotation -= 360.0f;
+    }
+
+    virtual void onReceiveClientCommand(int32_t client_id, sp::io::DataBuffer& packet) override
+    {
+        float dx = 0.0f;
+        float dy = 0.0f;
+        packet >> dx >> dy;
+        velocity_x += dx;
+        velocity_y += dy;
+        command_count++;
+    }
+};
+REGISTER_MULTIPLAYER_CLASS(LoadTestObject, "LoadTestObject");
+
+//A client that speaks the protocol directly, without any of the object replication of GameClient.
+class LoadTestClient
+{
+public:
+    sp::io::network::TcpSocket socket;
+    int32_t client_id = -1;
+    bool connected = false;
+    bool authenticated = false;
+
+    uint32_t command_sequence = 0;
+    float command_budget = 0.0f;
+    std::deque<std::pair<uint32_t, double>> pending_commands; //Sequence and send time of unacknowledged commands.
+
+    bool connect(int port)
+    {
+        if (!socket.connect(sp::io::network::Address("127.0.0.1"), port))
+            return false;
+        socket.setBlocking(false);
+        socket.setDelay(false);
+        connected = true;
+        return true;
+    }
+
+    void update(std::vector<float>& time_sync_latency, std::vector<float>& command_latency)
+    {
+        if (!connected)
+            return;
+        sp::io::DataBuffer packet;
+        while(socket.receive(packet))
+        {
+            command_t command;
+            packet >> command;
+            switch(command)
+            {
+            case CMD_REQUEST_AUTH:
+                {
+                    sp::io::DataBuffer reply;
+                    reply << CMD_CLIENT_SEND_AUTH << int32_t(loadtest_version) << string("");
+                    socket.send(reply);
+                }
+                break;
+            case CMD_SET_CLIENT_ID:
+                packet >> client_id;
+                authenticated = true;
+                break;
+            case CMD_ALIVE:
+                {
+                    sp::io::DataBuffer reply;
+                    reply << CMD_ALIVE_RESP;
+                    socket.send(reply);
+                }
+                break;
+            case CMD_TIME_SYNC:
+                {
+                    double server_time = 0.0;
+                    packet >> server_time;
+                    sp::io::DataBuffer reply;
+                    reply << CMD_TIME_SYNC_RESP << server_time << NetworkTiming::now();
+                    socket.send(reply);
+                }
+                break;
+            case CMD_TIME_SYNC_RESP:
+                {
+                    double send_time = 0.0;
+                    packet >> send_time;
+                    time_sync_latency.push_back(float(NetworkTiming::now() - send_time));
+                }
+                break;
+            case CMD_CLIENT_COMMAND_ACK:
+                {
+                    uint32_t sequence = 0;
+                    packet >> sequence;
+                    double now = NetworkTiming::now();
+                    while(!pending_commands.empty() && pending_commands.front().first <= sequence)
+                    {
+                        command_latency.push_back(float(now - pending_commands.front().second));
+                        pending_commands.pop_front();
+                    }
+                }
+                break;
+            default:
+                //Object creation and updates, only the amount of data matters here.
+                break;
+            }
+        }
+        if (!socket.isConnected())
+            connected = false;
+    }
+
+    void sendTimeSync()
+    {
+        if (!authenticated)
+            return;
+        sp::io::DataBuffer packet;
+        packet << CMD_TIME_SYNC << NetworkTiming::now();
+        socket.send(packet);
+    }
+
+    void sendCommands(float delta, float command_rate, size_t command_size, const std::vector<int32_t>& object_ids)
+    {
+        if (!authenticated || command_rate <= 0.0f || object_ids.empty())
+            return;
+        command_budget += command_rate * delta;
+        if (command_budget < 1.0f)
+            return;
+
+        //Send all commands of this tick as one batch, like GameClient does.
+        sp::io::DataBuffer packet;
+        packet << CMD_CLIENT_COMMAND;
+        double now = NetworkTiming::now();
+        while(command_budget >= 1.0f)
+        {
+            command_budget -= 1.0f;
+            command_sequence++;
+            sp::io::DataBuffer command;
+            command << random(-1.0f, 1.0f) << random(-1.0f, 1.0f);
+            while(command.getDataSize() < command_size)
+                command << uint8_t(0);
+            packet << object_ids[irandom(0, int(object_ids.size()) - 1)] << command_sequence << uint32_t(command.getDataSize());
+            packet.appendRaw(command.getData(), command.getDataSize());
+            pending_commands.emplace_back(command_sequence, now);
+        }
+        socket.send(packet);
+    }
+};
+
+struct LoadTestSettings
+{
+    std::vector<int> client_counts{1, 10, 50, 100};
+    int object_count = 500;
+    float duration = 10.0f;
+    int port = 35700;
+    float command_rate = 0.0f;   //Commands per second per client
+    size_t command_size = 16;    //Payload bytes per command
+    float tick_rate = 60.0f;
+};
+
+static float percentile(std::vector<float>& samples, float p)
+{
+    if (samples.empty())
+        return 0.0f;
+    size_t index = std::min(samples.size() - 1, size_t(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+static bool parseArguments(int argc, char** argv, LoadTestSettings& settings)
+{
+    for(int n=1; n<argc; n++)
+    {
+        string arg = argv[n];
+        if (n + 1 >= argc)
+            return false;
+        string value = argv[++n];
+        if (arg == "--clients")
+        {
+            settings.client_counts.clear();
+            for(auto& count : value.split(","))
+                settings.client_counts.push_back(count.toInt());
+        }
+        else if (arg == "--objects")
+            settings.object_count = value.toInt();
+        else if (arg == "--duration")
+            settings.duration = value.toFloat();
+        else if (arg == "--port")
+            settings.port = value.toInt();
+        else if (arg == "--command-rate")
+            settings.command_rate = value.toFloat();
+        else if (arg == "--command-size")
+            settings.command_size = value.toInt();
+        else if (arg == "--tick-rate")
+            settings.tick_rate = value.toFloat();
+        else
+            return false;
+    }
+    std::sort(settings.client_counts.begin(), settings.client_counts.end());
+    return !settings.client_counts.empty() && settings.tick_rate > 0.0f;
+}
+
+//Run a single engine tick, like the headless main loop of the engine does.
+static void tick(float delta)
+{
+    foreach(Updatable, u, updatableList)
+        u->update(delta);
+}
+
+int main(int argc, char** argv)
+{
+    LoadTestSettings settings;
+    if (!parseArguments(argc, argv, settings))
+    {
+        fprintf(stderr, "Usage: %s [--clients 1,10,50,100] [--objects 500] [--duration 10] [--port 35700] [--command-rate 0] [--command-size 16] [--tick-rate 60]\n", argv[0]);
+        return 1;
+    }
+
+    new Engine();
+    P<GameServer> server = new GameServer("Load test", loadtest_version, settings.port);
+
+    std::vector<int32_t> object_ids;
+    for(int n=0; n<settings.object_count; n++)
+    {
+        P<LoadTestObject> obj = new LoadTestObject();
+        object_ids.push_back(obj->getMultiplayerId());
+    }
+
+    const float tick_time = 1.0f / settings.tick_rate;
+    std::vector<std::unique_ptr<LoadTestClient>> clients;
+
+    auto pumpClients = [&](float delta, std::vector<float>& time_sync_latency, std::vector<float>& command_latency)
+    {
+        for(auto& client : clients)
+        {
+            client->update(time_sync_latency, command_latency);
+            client->sendCommands(delta, settings.command_rate, settings.command_size, object_ids);
+        }
+    };
+
+    printf("%8s %10s %10s %12s %12s %12s %10s %10s %10s %10s %10s %6s\n",
+        "clients", "tick_ms", "tick_max", "KB/s/client", "queue_KB", "queue_max", "rtt_p50", "rtt_p99", "rtt_max", "ack_p50", "ack_p99", "lost");
+    for(int client_count : settings.client_counts)
+    {
+        std::vector<float> time_sync_latency;
+        std::vector<float> command_latency;
+
+        //Connect the new clients, ticking the server in between so the accept backlog keeps draining.
+        while(int(clients.size()) < client_count)
+        {
+            auto client = std::make_unique<LoadTestClient>();
+            if (!client->connect(settings.port))
+            {
+                fprintf(stderr, "Failed to connect client %d\n", int(clients.size()));
+                break;
+            }
+            clients.push_back(std::move(client));
+            tick(tick_time);
+            pumpClients(tick_time, time_sync_latency, command_latency);
+        }
+        sp::SystemTimer auth_timeout;
+        auth_timeout.start(10.0f);
+        while(!auth_timeout.isExpired() && std::any_of(clients.begin(), clients.end(), [](const std::unique_ptr<LoadTestClient>& c) { return c->connected && !c->authenticated; }))
+        {
+            tick(tick_time);
+            pumpClients(tick_time, time_sync_latency, command_latency);
+        }
+        time_sync_latency.clear();
+        command_latency.clear();
+
+        std::vector<uint64_t> bytes_at_start;
+        for(auto& client : clients)
+            bytes_at_start.push_back(client->socket.getStatistics().bytes_received);
+
+        double tick_time_total = 0.0;
+        float tick_time_max = 0.0f;
+        double queue_total = 0.0;
+        size_t queue_max = 0;
+        int tick_count = 0;
+        int queue_sample_count = 0;
+        sp::SystemTimer time_sync_timer;
+        time_sync_timer.repeat(0.1f);
+        sp::SystemStopwatch step_time;
+        sp::SystemStopwatch frame_timer;
+        while(step_time.get() < settings.duration)
+        {
+            float delta = std::min(0.5f, std::max(0.001f, frame_timer.restart()));
+            tick(delta);
+            tick_time_total += server->getUpdateTime();
+            tick_time_max = std::max(tick_time_max, server->getUpdateTime());
+            tick_count++;
+
+            for(int32_t id : server->getClientIds())
+            {
+                size_t queue_size = server->getClientStatistics(id).send_queue_size;
+                queue_total += queue_size;
+                queue_max = std::max(queue_max, queue_size);
+                queue_sample_count++;
+            }
+
+            if (time_sync_timer.isExpired())
+            {
+                for(auto& client : clients)
+                    client->sendTimeSync();
+            }
+            pumpClients(delta, time_sync_latency, command_latency);
+
+            float work_time = frame_timer.get();
+            if (work_time < tick_time)
+                std::this_thread::sleep_for(std::chrono::duration<float>(tick_time - work_time));
+        }
+
+        uint64_t bytes_received = 0;
+        int lost = 0;
+        for(size_t n=0; n<clients.size(); n++)
+        {
+            bytes_received += clients[n]->socket.getStatistics().bytes_received - bytes_at_start[n];
+            if (!clients[n]->connected)
+                lost++;
+        }
+        printf("%8d %10.3f %10.3f %12.1f %12.1f %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f %6d\n",
+            int(clients.size()),
+            tick_count ? tick_time_total / tick_count * 1000.0 : 0.0,
+            tick_time_max * 1000.0f,
+            clients.empty() ? 0.0 : double(bytes_received) / clients.size() / settings.duration / 1024.0,
+            queue_sample_count ? queue_total / queue_sample_count / 1024.0 : 0.0,
+            double(queue_max) / 1024.0,
+            percentile(time_sync_latency, 0.5f) * 1000.0f,
+            percentile(time_sync_latency, 0.99f) * 1000.0f,
+            time_sync_latency.empty() ? 0.0f : *std::max_element(time_sync_latency.begin(), time_sync_latency.end()) * 1000.0f,
+            percentile(command_latency, 0.5f) * 1000.0f,
+            percentile(command_latency, 0.99f) * 1000.0f,
+            lost);
+        fflush(stdout);
+    }
+
+    clients.clear();
+    server->destroy();
+    return 0;
+}
@@ -0,0 +1,533 @@
+//Self check of the replication stream of the multiplayer server.
+//Runs a GameServer in-process with raw protocol clients that decode what they receive, and checks the edge cases of
+//the string table, LOD tiers and visibility that are hard to hit by playing a game.
+//
+//Usage: multiplayer_replication_test [--port 35800]
+//Prints a line per check and exits with 1 if any of them failed.
+#include "engine.h"
+#include "multiplayer.h"
+#include "multiplayer_server.h"
+#include "multiplayer_internal.h"
+#include "multiplayer_string_table.h"
+#include "multiplayer_lockstep.h"
+#include "multiplayer_world_cache.h"
+#include "collisionable.h"
+#include "io/network/tcpSocket.h"
+#include "io/network/tcpListener.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+
+static constexpr int test_version = 1;
+
+//Replicated object with a single string member, which is always written through the string table.
+class ReplicationTestObject : public MultiplayerObject, public Collisionable
+{
+public:
+    string label;
+
+    ReplicationTestObject()
+    : MultiplayerObject("ReplicationTestObject"), Collisionable(1.0f)
+    {
+        registerMemberReplication(&label);
+    }
+};
+REGISTER_MULTIPLAYER_CLASS(ReplicationTestObject, "ReplicationTestObject");
+
+//Object with a large create packet and no updates, to spread the creates for a joining client over several updates.
+class ReplicationPaddingObject : public MultiplayerObject
+{
+public:
+    std::vector<int32_t> payload;
+
+    ReplicationPaddingObject()
+    : MultiplayerObject("ReplicationPaddingObject"), payload(1024)
+    {
+        registerMemberReplication(&payload);
+    }
+};
+REGISTER_MULTIPLAYER_CLASS(ReplicationPaddingObject, "ReplicationPaddingObject");
+
+//Lockstep object that only records what it simulates.
+class LockstepTestObject : public LockstepObject
+{
+public:
+    std::vector<uint32_t> ticks;
+    std::vector<int32_t> inputs;   //Value of each input, in simulation order
+
+    LockstepTestObject()
+    : LockstepObject("LockstepTestObject")
+    {
+    }
+
+protected:
+    virtual void onLockstepTick(uint32_t tick, std::vector<LockstepInput>& tick_inputs) override
+    {
+        ticks.push_back(tick);
+        for(auto& input : tick_inputs)
+        {
+            int32_t value = 0;
+            input.data >> value;
+            inputs.push_back(value);
+        }
+    }
+
+    virtual uint32_t getLockstepChecksum() override { return 0; }
+};
+REGISTER_MULTIPLAYER_CLASS(LockstepTestObject, "LockstepTestObject");
+
+//A client that speaks the protocol directly and decodes ReplicationTestObjects with its own string table, other objects are only counted.
+class TestClient
+{
+public:
+    sp::io::network::TcpSocket socket;
+    ReplicationStringTable string_table;
+    int32_t client_id = -1;
+    bool connected = false;
+    bool authenticated = false;
+
+    std::unordered_map<int32_t, string> labels;             //Label of each created object
+    std::unordered_map<int32_t, int> object_packets;        //Creates, updates and server commands received per object
+    std::vector<string> definitions;                        //All string table definitions received
+    uint32_t acked_command = 0;
+    std::unordered_map<int32_t, int> object_packets_at_ack; //Copy of object_packets when the last command acknowledgement arrived
+    std::unordered_map<int32_t, std::vector<uint32_t>> server_command_ticks; //First value of each server command per object, the tick for lockstep objects
+    std::unique_ptr<ReplicationWorldCache> world_cache; //When set, fed with the world part of the stream like a proxy does
+
+    bool connect(int port)
+    {
+        if (!socket.connect(sp::io::network::Address("127.0.0.1"), port))
+            return false;
+        socket.setBlocking(false);
+        socket.setDelay(false);
+        connected = true;
+        return true;
+    }
+
+    void sendCommand(int32_t object_id, uint32_t sequence)
+    {
+        sp::io::DataBuffer packet;
+        packet << CMD_CLIENT_COMMAND << object_id << sequence << uint32_t(0);
+        socket.send(packet);
+    }
+
+    void update()
+    {
+        if (!connected)
+            return;
+        sp::io::DataBuffer packet;
+        while(socket.receive(packet))
+        {
+            command_t command;
+            packet >> command;
+            if (world_cache)
+            {
+                sp::io::DataBuffer copy;
+                copy.appendRaw(packet.getView().getRemainingData(), packet.available());
+                world_cache->receive(command, copy);
+            }
+            switch(command)
+            {
+            case CMD_REQUEST_AUTH:
+                {
+                    sp::io::DataBuffer reply;
+                    reply << CMD_CLIENT_SEND_AUTH << int32_t(test_version) << string("");
+                    socket.send(reply);
+                }
+                break;
+            case CMD_SET_CLIENT_ID:
+                packet >> client_id;
+                authenticated = true;
+                break;
+            case CMD_ALIVE:
+                {
+                    sp::io::DataBuffer reply;
+                    reply << CMD_ALIVE_RESP;
+                    socket.send(reply);
+                }
+                break;
+            case CMD_STRING_TABLE_SET:
+                {
+                    uint32_t id;
+                    string value;
+                    packet >> id >> value;
+                    string_table.define(id, value);
+                    definitions.push_back(value);
+                }
+                break;
+            case CMD_CREATE:
+                {
+                    int32_t id;
+                    packet >> id;
+                    object_packets[id]++;
+                    if (string_table.read(packet) == "ReplicationTestObject")
+                    {
+                        labels[id] = "";
+                        readMembers(id, packet);
+                    }
+                }
+                break;
+            case CMD_UPDATE_VALUE:
+                {
+                    int32_t id;
+                    packet >> id;
+                    object_packets[id]++;
+                    if (labels.find(id) != labels.end())
+                        readMembers(id, packet);
+                }
+                break;
+            case CMD_SERVER_COMMAND:
+                {
+                    int32_t id;
+                    packet >> id;
+                    object_packets[id]++;
+                    if (packet.available() >= sizeof(uint32_t))
+                    {
+                        uint32_t tick;
+                        packet >> tick;
+                        server_command_ticks[id].push_back(tick);
+                    }
+                }
+                break;
+            case CMD_CLIENT_COMMAND_ACK:
+                packet >> acked_command;
+                object_packets_at_ack = object_packets;
+                break;
+            case CMD_DELETE:
+                {
+                    int32_t id;
+                    packet >> id;
+                    labels.erase(id);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        if (!socket.isConnected())
+            connected = false;
+    }
+
+private:
+    void readMembers(int32_t id, sp::io::DataBuffer& packet)
+    {
+        while(packet.available() > 0)
+        {
+            int16_t index;
+            uint32_t size;
+            packet >> index >> size;
+            labels[id] = string_table.read(packet);
+        }
+    }
+};
+
+struct TestContext
+{
+    int port;
+    P<GameServer> server;
+    std::vector<std::unique_ptr<TestClient>> clients;
+    std::vector<P<MultiplayerObject>> objects;
+    std::function<void()> on_tick;  //Changes to the world made every tick, before the server update
+
+    P<ReplicationTestObject> createObject(glm::vec2 position, string label)
+    {
+        P<ReplicationTestObject> obj = new ReplicationTestObject();
+        obj->setPosition(position);
+        obj->label = label;
+        objects.push_back(obj);
+        return obj;
+    }
+
+    //Run a single engine tick, like the headless main loop of the engine does, and handle what the clients received.
+    void tick()
+    {
+        if (on_tick)
+            on_tick();
+        foreach(Updatable, u, updatableList)
+            u->update(1.0f / 60.0f);
+        for(auto& client : clients)
+            client->update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    bool runUntil(const std::function<bool()>& condition, float timeout)
+    {
+        sp::SystemTimer timer;
+        timer.start(timeout);
+        while(!condition())
+        {
+            if (timer.isExpired())
+                return false;
+            tick();
+        }
+        return true;
+    }
+
+    TestClient* connectClient()
+    {
+        auto client = std::make_unique<TestClient>();
+        if (!client->connect(port))
+            return nullptr;
+        TestClient* result = client.get();
+        clients.push_back(std::move(client));
+        if (!runUntil([result]() { return result->authenticated; }, 5.0f))
+            return nullptr;
+        return result;
+    }
+};
+
+static int failures = 0;
+
+static bool check(bool condition, const char* test, const char* description)
+{
+    if (!condition)
+    {
+        printf("FAIL %s: %s\n", test, description);
+        failures++;
+    }
+    return condition;
+}
+
+//A string that is evicted from the table while a LOD deferred update still refers to it by id.
+static void testStringEvictionWithLodDeferredUpdate(TestContext& context)
+{
+    const char* name = "string eviction with LOD deferred update";
+    context.server->getStringTable().setMaxSize(ReplicationStringTable::min_table_size);
+    context.server->setReplicationLodTiers({{100.0f, 10.0f}});
+    P<ReplicationTestObject> near_object = context.createObject({0, 0}, "near label");
+    P<ReplicationTestObject> far_object = context.createObject({1000, 0}, "far label 0");
+    int32_t far_id = far_object->getMultiplayerId();
+
+    TestClient* client = context.connectClient();
+    if (!check(client != nullptr, name, "client did not connect"))
+        return;
+    context.server->setClientFocusObject(client->client_id, near_object);
+    if (!check(context.runUntil([client, far_id]() { return client->labels.count(far_id) > 0; }, 5.0f), name, "object not created"))
+        return;
+
+    //The first update goes out right away and starts the LOD interval, the second one is held back.
+    far_object->label = "far label 1";
+    if (!check(context.runUntil([client, far_id]() { return client->labels[far_id] == "far label 1"; }, 5.0f), name, "first update not received"))
+        return;
+    far_object->label = "far label 2";
+    for(int n=0; n<10; n++)
+        context.tick();
+    if (!check(client->labels[far_id] == "far label 1", name, "update was not deferred by the LOD tier"))
+        return;
+
+    //Cycle through enough new strings to evict every id, including the one of the deferred label.
+    for(uint32_t n=0; n<ReplicationStringTable::min_table_size * 2; n++)
+    {
+        near_object->label = "churn label " + string(int(n));
+        context.tick();
+    }
+    context.runUntil([client, far_id]() { return client->labels[far_id] != "far label 1"; }, 15.0f);
+    check(client->labels[far_id] == "far label 2", name, "deferred update decoded with a reused string id");
+}
+
+//A client that joins while the creates of the existing objects are still pending gets nothing of objects it cannot see,
+// not even the strings of their members and server commands through the string table.
+static void testJoinWithHiddenObject(TestContext& context)
+{
+    const char* name = "join with hidden object";
+    TestClient* owner = context.connectClient();
+    if (!check(owner != nullptr, name, "first client did not connect"))
+        return;
+    for(int n=0; n<200; n++)
+        context.objects.push_back(new ReplicationPaddingObject());
+    P<ReplicationTestObject> hidden_object = context.createObject({0, 0}, "hidden label");
+    hidden_object->setReplicationVisibleClients({owner->client_id});
+    int32_t hidden_id = hidden_object->getMultiplayerId();
+    if (!check(context.runUntil([owner, hidden_id]() { return owner->labels.count(hidden_id) > 0; }, 5.0f), name, "object not created on the client that can see it"))
+        return;
+
+    int counter = 0;
+    context.on_tick = [hidden_object, &counter]()
+    {
+        if (!hidden_object)
+            return;
+        hidden_object->label = "hidden label " + string(counter++);
+        sp::io::DataBuffer packet;
+        packet << int32_t(counter);
+        hidden_object->writeTableString(packet, "hidden command " + string(counter));
+        hidden_object->broadcastServerCommand(packet);
+    };
+    TestClient* joining = context.connectClient();
+    if (check(joining != nullptr, name, "second client did not connect"))
+    {
+        GameServer* server = *context.server;
+        if (check(server->getClientStatistics(joining->client_id).pending_creates > 0, name, "creates were not spread over several updates"))
+        {
+            context.runUntil([server, joining]() { return server->getClientStatistics(joining->client_id).pending_creates == 0; }, 10.0f);
+            for(int n=0; n<10; n++)
+                context.tick();
+            check(owner->labels[hidden_id] != "hidden label", name, "client that can see the object got no updates");
+            check(joining->object_packets[hidden_id] == 0, name, "hidden object send to a client that cannot see it");
+            check(std::none_of(joining->definitions.begin(), joining->definitions.end(), [](const string& s) { return s.startswith("hidden"); }),
+                name, "string of a hidden object send as string table definition");
+        }
+    }
+    context.on_tick = nullptr;
+}
+
+//A command for a predicted object gets the full state of that object to the commanding client before the acknowledgement, and to nobody else.
+static void testPredictedCommandAcknowledgement(TestContext& context)
+{
+    const char* name = "predicted command acknowledgement";
+    TestClient* commanding = context.connectClient();
+    TestClient* other = context.connectClient();
+    if (!check(commanding != nullptr && other != nullptr, name, "clients did not connect"))
+        return;
+    P<ReplicationTestObject> obj = context.createObject({0, 0}, "predicted label");
+    obj->setClientPrediction(true);
+    int32_t id = obj->getMultiplayerId();
+    if (!check(context.runUntil([commanding, other, id]() { return commanding->labels.count(id) > 0 && other->labels.count(id) > 0; }, 5.0f), name, "object not created"))
+        return;
+
+    int commanding_before = commanding->object_packets[id];
+    int other_before = other->object_packets[id];
+    commanding->sendCommand(id, 1);
+    if (!check(context.runUntil([commanding]() { return commanding->acked_command == 1; }, 5.0f), name, "command not acknowledged"))
+        return;
+    for(int n=0; n<10; n++)
+        context.tick();
+    check(commanding->object_packets_at_ack[id] > commanding_before, name, "full state not send before the acknowledgement");
+    check(other->object_packets[id] == other_before, name, "full state send to a client that did not command the object");
+}
+
+//A lockstep server that catches up several ticks in one update broadcasts each tick once, with the inputs queued for it.
+static void testLockstepCatchUp(TestContext& context)
+{
+    const char* name = "lockstep catch up";
+    TestClient* client = context.connectClient();
+    if (!check(client != nullptr, name, "client did not connect"))
+        return;
+    P<LockstepTestObject> obj = new LockstepTestObject();
+    context.objects.push_back(obj);
+    int32_t id = obj->getMultiplayerId();
+    if (!check(context.runUntil([client, id]() { return client->object_packets.count(id) > 0; }, 5.0f), name, "object not created"))
+        return;
+
+    for(int32_t n=0; n<3; n++)
+    {
+        sp::io::DataBuffer input;
+        input << n;
+        obj->sendLockstepInput(input);
+    }
+    uint32_t tick_before = obj->getLockstepTick();
+    obj->update(obj->getLockstepDelta() * LockstepObject::maxTicksPerUpdate);
+    check(obj->getLockstepTick() == tick_before + LockstepObject::maxTicksPerUpdate, name, "server did not catch up");
+    check(obj->inputs == std::vector<int32_t>({0, 1, 2}), name, "queued inputs lost");
+    bool consecutive = true;
+    for(size_t n=1; n<obj->ticks.size(); n++)
+        if (obj->ticks[n] != obj->ticks[n - 1] + 1)
+            consecutive = false;
+    check(consecutive, name, "server did not simulate consecutive ticks");
+
+    context.runUntil([client, id, obj]() { auto& ticks = client->server_command_ticks[id]; return !ticks.empty() && ticks.back() >= obj->getLockstepTick(); }, 5.0f);
+    auto& ticks = client->server_command_ticks[id];
+    check(std::adjacent_find(ticks.begin(), ticks.end(), [](uint32_t a, uint32_t b) { return b != a + 1; }) == ticks.end(), name, "ticks broadcast more than once or skipped");
+}
+
+//The world cache of a proxy splits members by their size only. A snapshot of it has to give a new client the same world,
+// also for strings whose table id was redefined after they were cached.
+static void testWorldCacheSnapshot(TestContext& context)
+{
+    const char* name = "world cache snapshot";
+    context.server->getStringTable().setMaxSize(ReplicationStringTable::min_table_size);
+    TestClient* upstream = context.connectClient();
+    if (!check(upstream != nullptr, name, "client did not connect"))
+        return;
+    upstream->world_cache = std::make_unique<ReplicationWorldCache>();
+    ReplicationWorldCache& cache = *upstream->world_cache;
+    P<ReplicationTestObject> labeled = context.createObject({0, 0}, "cached label");
+    P<ReplicationPaddingObject> padding = new ReplicationPaddingObject();
+    context.objects.push_back(padding);
+    int32_t labeled_id = labeled->getMultiplayerId();
+    int32_t padding_id = padding->getMultiplayerId();
+    if (!check(context.runUntil([upstream, labeled_id, padding_id]() { return upstream->labels.count(labeled_id) > 0 && upstream->object_packets.count(padding_id) > 0; }, 5.0f), name, "objects not created"))
+        return;
+
+    P<ReplicationTestObject> churn = context.createObject({0, 0}, "");
+    for(uint32_t n=0; n<ReplicationStringTable::min_table_size * 2; n++)
+    {
+        churn->label = "churn label " + string(int(n));
+        context.tick();
+    }
+    if (!check(cache.isValid(), name, "cache could not split the stream"))
+        return;
+
+    //Send the snapshot over a loopback connection to a client that has seen nothing else.
+    sp::io::network::TcpListener listener;
+    TestClient joining;
+    sp::io::network::TcpSocket snapshot_socket;
+    if (!check(listener.listen(context.port + 1) && joining.connect(context.port + 1) && listener.accept(snapshot_socket), name, "could not connect the snapshot socket"))
+        return;
+    cache.queueSnapshot(snapshot_socket);
+    sp::io::DataBuffer end_marker;
+    end_marker << CMD_CLIENT_COMMAND_ACK << uint32_t(1);
+    snapshot_socket.queue(end_marker);
+    sp::SystemTimer timer;
+    timer.start(5.0f);
+    while(joining.acked_command == 0 && !timer.isExpired())
+    {
+        snapshot_socket.sendSendQueue();
+        joining.update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    check(joining.acked_command == 1, name, "snapshot not received");
+    check(joining.labels[labeled_id] == "cached label", name, "string member decoded wrong from the snapshot");
+    check(joining.object_packets[padding_id] == 1, name, "object without strings missing from the snapshot");
+}
+
+int main(int argc, char** argv)
+{
+    TestContext context;
+    context.port = 35800;
+    for(int n=1; n<argc; n++)
+    {
+        if (string(argv[n]) == "--port" && n + 1 < argc)
+        {
+            context.port = string(argv[++n]).toInt();
+        }else{
+            fprintf(stderr, "Usage: %s [--port 35800]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    new Engine();
+    context.server = new GameServer("Replication test", test_version, context.port);
+
+    std::vector<std::pair<const char*, std::function<void(TestContext&)>>> tests{
+        {"string eviction with LOD deferred update", testStringEvictionWithLodDeferredUpdate},
+        {"join with hidden object", testJoinWithHiddenObject},
+        {"predicted command acknowledgement", testPredictedCommandAcknowledgement},
+        {"lockstep catch up", testLockstepCatchUp},
+        {"world cache snapshot", testWorldCacheSnapshot},
+    };
+    for(auto& test : tests)
+    {
+        int failures_before = failures;
+        test.second(context);
+        context.clients.clear();
+        for(auto& obj : context.objects)
+            if (obj)
+                obj->destroy();
+        context.objects.clear();
+        context.server->setReplicationLodTiers({});
+        context.server->getStringTable().setMaxSize(ReplicationStringTable::default_table_size);
+        //Let the server notice the closed connections and the destroyed objects before the next check.
+        for(int n=0; n<10; n++)
+            context.tick();
+        if (failures == failures_before)
+            printf("PASS %s\n", test.first);
+    }
+
+    context.server->destroy();
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,116 @@
+//Self check of the send queue of TcpSocket.
+//Connects two sockets over the loopback interface and checks the queue on a receiver that stays just behind the sender,
+//the situation of a slow client on the multiplayer server.
+//
+//Usage: tcp_socket_test [--port 35900]
+//Prints a line per check and exits with 1 if any of them failed.
+#include "io/network/tcpSocket.h"
+#include "io/network/tcpListener.h"
+#include "stringImproved.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+
+static int failures = 0;
+
+static bool check(bool condition, const char* test, const char* description)
+{
+    if (!condition)
+    {
+        printf("FAIL %s: %s\n", test, description);
+        failures++;
+    }
+    return condition;
+}
+
+static bool connectPair(int port, sp::io::network::TcpSocket& sender, sp::io::network::TcpSocket& receiver)
+{
+    sp::io::network::TcpListener listener;
+    if (!listener.listen(port))
+        return false;
+    if (!sender.connect(sp::io::network::Address("127.0.0.1"), port))
+        return false;
+    if (!listener.accept(receiver))
+        return false;
+    sender.setBlocking(false);
+    receiver.setBlocking(false);
+    return true;
+}
+
+static sp::io::DataBuffer makeFrame(uint32_t sequence)
+{
+    sp::io::DataBuffer frame;
+    frame << sequence;
+    for(int n=0; n<255; n++)
+        frame << sequence;
+    return frame;
+}
+
+//Keep sending while the receiver reads as much as is send, with the queue never running empty.
+// Segments that started sending must not take new data, else the storage of the queue grows with everything ever send.
+static void testSlowReceiverQueueStorage(int port)
+{
+    const char* name = "send queue storage with a lagging receiver";
+    sp::io::network::TcpSocket sender;
+    sp::io::network::TcpSocket receiver;
+    if (!check(connectPair(port, sender, receiver), name, "could not connect the sockets"))
+        return;
+
+    //Fill the buffers of the OS till the socket has to queue.
+    uint32_t send_sequence = 0;
+    while(sender.getSendQueueSize() == 0 && send_sequence < 1000000)
+        sender.send(makeFrame(send_sequence++));
+    if (!check(sender.getSendQueueSize() > 0, name, "send queue never used"))
+        return;
+
+    uint32_t receive_sequence = 0;
+    bool in_order = true;
+    sp::io::DataBuffer frame;
+    for(int iteration=0; iteration<20000; iteration++)
+    {
+        for(int n=0; n<4; n++)
+            sender.send(makeFrame(send_sequence++));
+        for(int n=0; n<4 && receiver.receive(frame); n++)
+        {
+            uint32_t sequence = 0;
+            frame >> sequence;
+            if (sequence != receive_sequence++)
+                in_order = false;
+        }
+    }
+    size_t queue_peak = sender.getStatistics().peak_send_queue_size;
+    size_t storage = sender.getSendQueueStorage();
+    check(in_order, name, "frames received out of order");
+    check(storage <= queue_peak * 4 + 1024 * 1024, name, "queue storage grows beyond the queued data");
+    printf("     %s: %u frames send, queue peak %zu bytes, storage %zu bytes\n", name, send_sequence, queue_peak, storage);
+}
+
+int main(int argc, char** argv)
+{
+    int port = 35900;
+    for(int n=1; n<argc; n++)
+    {
+        if (string(argv[n]) == "--port" && n + 1 < argc)
+        {
+            port = string(argv[++n]).toInt();
+        }else{
+            fprintf(stderr, "Usage: %s [--port 35900]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<std::pair<const char*, std::function<void(int)>>> tests{
+        {"send queue storage with a lagging receiver", testSlowReceiverQueueStorage},
+    };
+    for(auto& test : tests)
+    {
+        int failures_before = failures;
+        test.second(port);
+        if (failures == failures_before)
+            printf("PASS %s\n", test.first);
+    }
+    return failures > 0 ? 1 : 0;
+}